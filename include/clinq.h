@@ -1,454 +1,5277 @@
 #pragma once
 
 #include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <array>
 #include <list>
+#include <deque>
 #include <set>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <functional>
+
+#if !defined(CLINQ_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define CLINQ_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if !defined(_MSC_VER) || _MSC_VER >= 1910
+#define CLINQ_SIMD_AVX512
+#endif
+#endif
+
+// Allows the kernels to use instructions the rest of the code is not compiled for. The loops they share are
+// forced inline, so they are compiled again inside each kernel instead of being called with the default ones.
+#if defined(__GNUC__)
+#define CLINQ_TARGET(x) __attribute__((target(x)))
+#define CLINQ_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define CLINQ_TARGET(x)
+#define CLINQ_INLINE __forceinline
+#else
+#define CLINQ_TARGET(x)
+#define CLINQ_INLINE inline
+#endif
+
+// Queries over arrays can be evaluated in constant expressions with C++20 compilers
+#if defined(__cpp_lib_is_constant_evaluated) && defined(__cpp_constexpr) && __cpp_constexpr >= 201907L
+#define CLINQ_HAS_CONSTEXPR
+#define CLINQ_CONSTEXPR constexpr
+#else
+#define CLINQ_CONSTEXPR
+#endif
+
+// Queries can be fed by C++20 coroutines, with from_generator()
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define CLINQ_HAS_COROUTINES
+#include <coroutine>
+#endif
+
+// Bytes kept inside an any_query for the erased enumerator. Larger enumerators are allocated in the heap.
+#ifndef CLINQ_ANY_SIZE
+#define CLINQ_ANY_SIZE 256
+#endif
 
 
 namespace clinq
 {
 namespace detail
 {
+// Type returned by calling FUNC(ARGS...). Replaces std::result_of, that was removed in C++20.
+template <typename SIGNATURE>
+struct result_of;
+
+template <typename FUNC, typename... ARGS>
+struct result_of<FUNC(ARGS...)>
+{
+	typedef decltype(std::declval<FUNC>()(std::declval<ARGS>()...)) type;
+};
+
+
+// How an element is kept after get() returns: references are kept as pointers, values are copied
+template <typename T>
+struct storage
+{
+	typedef typename std::remove_cv<T>::type type;
+
+	CLINQ_CONSTEXPR static type store(T&& value) {
+		return std::move(value);
+	}
+
+	CLINQ_CONSTEXPR static type& load(type& value) {
+		return value;
+	}
+
+	// Moves the element out, when it will not be read again
+	CLINQ_CONSTEXPR static type&& release(type& value) {
+		return std::move(value);
+	}
+};
+
+template <typename T>
+struct storage<T&>
+{
+	typedef T* type;
+
+	CLINQ_CONSTEXPR static type store(T& value) {
+		return &value;
+	}
+
+	CLINQ_CONSTEXPR static T& load(type value) {
+		return *value;
+	}
+
+	CLINQ_CONSTEXPR static T& release(type value) {
+		return *value;
+	}
+};
+
+
+// Keeps the current element of an enumerator: references are kept as pointers, values are constructed in place
+template <typename T>
+class holder
+{
+	typedef typename std::remove_cv<T>::type type;
+
+#ifdef CLINQ_HAS_CONSTEXPR
+	// A union member can also be constructed and destroyed in constant expressions
+	union
+	{
+		type data;
+	};
+#else
+	typename std::aligned_storage<sizeof(type), std::alignment_of<type>::value>::type data;
+#endif
+	bool full;
+
+	holder(const holder&);
+	holder& operator=(const holder&);
+
+public:
+
+	CLINQ_CONSTEXPR holder()
+		: full(false) {
+	}
+
+	CLINQ_CONSTEXPR holder(holder&& other)
+		: full(false) {
+		if (other.full)
+			set(std::move(other.get()));
+	}
+
+	CLINQ_CONSTEXPR ~holder() {
+		clear();
+	}
+
+	CLINQ_CONSTEXPR void set(T&& value) {
+		clear();
+#ifdef CLINQ_HAS_CONSTEXPR
+		std::construct_at(&data, std::move(value));
+#else
+		new (&data) type(std::move(value));
+#endif
+		full = true;
+	}
+
+	CLINQ_CONSTEXPR type& get() {
+#ifdef CLINQ_HAS_CONSTEXPR
+		return data;
+#else
+		return *reinterpret_cast<type*>(&data);
+#endif
+	}
+
+	CLINQ_CONSTEXPR bool empty() const {
+		return !full;
+	}
+
+	CLINQ_CONSTEXPR void clear() {
+		if (full) {
+			get().~type();
+			full = false;
+		}
+	}
+};
+
+template <typename T>
+class holder<T&>
+{
+	T* value;
+
+public:
+
+	CLINQ_CONSTEXPR holder()
+		: value(nullptr) {
+	}
+
+	CLINQ_CONSTEXPR holder(holder&& other)
+		: value(other.value) {
+	}
+
+	CLINQ_CONSTEXPR void set(T& value) {
+		this->value = &value;
+	}
+
+	CLINQ_CONSTEXPR T& get() {
+		return *value;
+	}
+
+	CLINQ_CONSTEXPR bool empty() const {
+		return value == nullptr;
+	}
+
+	CLINQ_CONSTEXPR void clear() {
+		value = nullptr;
+	}
+};
+
+
+template <typename T>
+struct simple_type
+{
+	typedef typename std::remove_cv<typename std::remove_reference<T>::type>::type type;
+};
+
+
+// Size of the blocks used by next_batch()
+const std::size_t batch_size = 256;
+
+// Batches are only used when the stored elements are plain data (references are stored as pointers)
+template <typename T>
+struct is_batchable : std::is_trivial<typename storage<T>::type>
+{
+};
+
+template <typename ENUMERATOR>
+struct has_next_batch
+{
+	template <typename U>
+	static char test(decltype(&U::next_batch));
+
+	template <typename U>
+	static long test(...);
+
+	enum { value = sizeof(test<ENUMERATOR>(0)) == sizeof(char) };
+};
+
+// Fills out with up to max elements, one by one. Returns 0 only when there are no more elements.
+template <typename ENUMERATOR>
+std::size_t fill_batch(ENUMERATOR& enumerator, typename storage<typename ENUMERATOR::value_type>::type* out, std::size_t max) {
+	typedef storage<typename ENUMERATOR::value_type> storage_type;
+
+	std::size_t count = 0;
+	while (count < max && enumerator.next())
+		out[count++] = storage_type::store(enumerator.get());
+
+	return count;
+}
+
+template <typename ENUMERATOR>
+std::size_t next_batch(ENUMERATOR& enumerator, typename storage<typename ENUMERATOR::value_type>::type* out, std::size_t max, std::true_type) {
+	return enumerator.next_batch(out, max);
+}
+
+template <typename ENUMERATOR>
+std::size_t next_batch(ENUMERATOR& enumerator, typename storage<typename ENUMERATOR::value_type>::type* out, std::size_t max, std::false_type) {
+	return fill_batch(enumerator, out, max);
+}
+
+// Batch protocol: enumerators may implement next_batch(out, max), the others are consumed with next()/get().
+// The elements are valid until the following call. After a batch get() is invalid until next() is called again.
+template <typename ENUMERATOR>
+std::size_t next_batch(ENUMERATOR& enumerator, typename storage<typename ENUMERATOR::value_type>::type* out, std::size_t max) {
+	return next_batch(enumerator, out, max, std::integral_constant<bool, has_next_batch<ENUMERATOR>::value>());
+}
+
+// Push protocol: push(sink) calls sink(value) for each element until sink returns false.
+// Returns false if the sink stopped the enumeration. Enumerators without push() are consumed with next()/get().
+template <typename ENUMERATOR, typename SINK>
+CLINQ_CONSTEXPR auto push(ENUMERATOR& enumerator, SINK& sink, int) -> decltype(enumerator.push(sink)) {
+	return enumerator.push(sink);
+}
+
+template <typename ENUMERATOR, typename SINK>
+CLINQ_CONSTEXPR bool push(ENUMERATOR& enumerator, SINK& sink, long) {
+	while (enumerator.next()) {
+		if (!sink(enumerator.get()))
+			return false;
+	}
+
+	return true;
+}
+
+template <typename ENUMERATOR, typename SINK>
+CLINQ_CONSTEXPR bool push(ENUMERATOR& enumerator, SINK& sink) {
+	return push(enumerator, sink, 0);
+}
+
+// Limit protocol: limit(count) tells an enumerator that no more than count elements will be read from it.
+// Enumerators that buffer (order_by) use it to keep less elements, the ones that map 1:1 forward it to inner.
+template <typename ENUMERATOR>
+CLINQ_CONSTEXPR auto limit(ENUMERATOR& enumerator, std::size_t count, int) -> decltype(enumerator.limit(count)) {
+	return enumerator.limit(count);
+}
+
+template <typename ENUMERATOR>
+CLINQ_CONSTEXPR void limit(ENUMERATOR&, std::size_t, long) {
+}
+
+template <typename ENUMERATOR>
+CLINQ_CONSTEXPR void limit(ENUMERATOR& enumerator, std::size_t count) {
+	limit(enumerator, count, 0);
+}
+
+
+// Reads a batch from inner and applies transform to each element
+template <typename T, typename ENUMERATOR, typename TRANSFORM>
+std::size_t transform_batch(ENUMERATOR& inner, TRANSFORM& transform, typename storage<T>::type* out, std::size_t max) {
+	typedef storage<typename ENUMERATOR::value_type> inner_storage_type;
+	typedef storage<T> storage_type;
+
+	typename inner_storage_type::type values[batch_size];
+	std::size_t count = next_batch(inner, values, std::min(max, batch_size));
+
+	for (std::size_t i = 0; i < count; ++i)
+		out[i] = storage_type::store(transform(inner_storage_type::load(values[i])));
+
+	return count;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels for contiguous arithmetic sources. The instruction set is selected at runtime.
+
+
+enum simd_level_type
+{
+	simd_none,
+	simd_avx2,
+	simd_avx512
+};
+
+inline int detect_simd_level() {
+#if !defined(CLINQ_SIMD)
+	return simd_none;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return simd_none;
+
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0) // OSXSAVE
+		return simd_none;
+
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+
+#if defined(CLINQ_SIMD_AVX512)
+	if ((info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6)
+		return simd_avx512;
+#endif
+	if ((info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6)
+		return simd_avx2;
+
+	return simd_none;
+#else
+	__builtin_cpu_init();
+#if defined(CLINQ_SIMD_AVX512)
+	if (__builtin_cpu_supports("avx512f"))
+		return simd_avx512;
+#endif
+	if (__builtin_cpu_supports("avx2"))
+		return simd_avx2;
+
+	return simd_none;
+#endif
+}
+
+inline int simd_level() {
+	static const int level = detect_simd_level();
+	return level;
+}
+
+
+// Copies the elements of in that have keep[i] != 0 to out. out must have room for count elements.
+template <typename T>
+std::size_t compact_scalar(const T* in, const unsigned char* keep, std::size_t count, T* out) {
+	std::size_t result = 0;
+	for (std::size_t i = 0; i < count; ++i) {
+		out[result] = in[i];
+		result += keep[i] != 0 ? 1 : 0;
+	}
+	return result;
+}
+
+#if defined(CLINQ_SIMD)
+
+// Permutation that moves the selected lanes to the front, one byte per lane index, for each 8 bit mask
+inline const unsigned long long* compact_lanes32() {
+	static const unsigned long long lanes[256] = {
+		0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000001ull, 0x0000000000000100ull,
+		0x0000000000000002ull, 0x0000000000000200ull, 0x0000000000000201ull, 0x0000000000020100ull,
+		0x0000000000000003ull, 0x0000000000000300ull, 0x0000000000000301ull, 0x0000000000030100ull,
+		0x0000000000000302ull, 0x0000000000030200ull, 0x0000000000030201ull, 0x0000000003020100ull,
+		0x0000000000000004ull, 0x0000000000000400ull, 0x0000000000000401ull, 0x0000000000040100ull,
+		0x0000000000000402ull, 0x0000000000040200ull, 0x0000000000040201ull, 0x0000000004020100ull,
+		0x0000000000000403ull, 0x0000000000040300ull, 0x0000000000040301ull, 0x0000000004030100ull,
+		0x0000000000040302ull, 0x0000000004030200ull, 0x0000000004030201ull, 0x0000000403020100ull,
+		0x0000000000000005ull, 0x0000000000000500ull, 0x0000000000000501ull, 0x0000000000050100ull,
+		0x0000000000000502ull, 0x0000000000050200ull, 0x0000000000050201ull, 0x0000000005020100ull,
+		0x0000000000000503ull, 0x0000000000050300ull, 0x0000000000050301ull, 0x0000000005030100ull,
+		0x0000000000050302ull, 0x0000000005030200ull, 0x0000000005030201ull, 0x0000000503020100ull,
+		0x0000000000000504ull, 0x0000000000050400ull, 0x0000000000050401ull, 0x0000000005040100ull,
+		0x0000000000050402ull, 0x0000000005040200ull, 0x0000000005040201ull, 0x0000000504020100ull,
+		0x0000000000050403ull, 0x0000000005040300ull, 0x0000000005040301ull, 0x0000000504030100ull,
+		0x0000000005040302ull, 0x0000000504030200ull, 0x0000000504030201ull, 0x0000050403020100ull,
+		0x0000000000000006ull, 0x0000000000000600ull, 0x0000000000000601ull, 0x0000000000060100ull,
+		0x0000000000000602ull, 0x0000000000060200ull, 0x0000000000060201ull, 0x0000000006020100ull,
+		0x0000000000000603ull, 0x0000000000060300ull, 0x0000000000060301ull, 0x0000000006030100ull,
+		0x0000000000060302ull, 0x0000000006030200ull, 0x0000000006030201ull, 0x0000000603020100ull,
+		0x0000000000000604ull, 0x0000000000060400ull, 0x0000000000060401ull, 0x0000000006040100ull,
+		0x0000000000060402ull, 0x0000000006040200ull, 0x0000000006040201ull, 0x0000000604020100ull,
+		0x0000000000060403ull, 0x0000000006040300ull, 0x0000000006040301ull, 0x0000000604030100ull,
+		0x0000000006040302ull, 0x0000000604030200ull, 0x0000000604030201ull, 0x0000060403020100ull,
+		0x0000000000000605ull, 0x0000000000060500ull, 0x0000000000060501ull, 0x0000000006050100ull,
+		0x0000000000060502ull, 0x0000000006050200ull, 0x0000000006050201ull, 0x0000000605020100ull,
+		0x0000000000060503ull, 0x0000000006050300ull, 0x0000000006050301ull, 0x0000000605030100ull,
+		0x0000000006050302ull, 0x0000000605030200ull, 0x0000000605030201ull, 0x0000060503020100ull,
+		0x0000000000060504ull, 0x0000000006050400ull, 0x0000000006050401ull, 0x0000000605040100ull,
+		0x0000000006050402ull, 0x0000000605040200ull, 0x0000000605040201ull, 0x0000060504020100ull,
+		0x0000000006050403ull, 0x0000000605040300ull, 0x0000000605040301ull, 0x0000060504030100ull,
+		0x0000000605040302ull, 0x0000060504030200ull, 0x0000060504030201ull, 0x0006050403020100ull,
+		0x0000000000000007ull, 0x0000000000000700ull, 0x0000000000000701ull, 0x0000000000070100ull,
+		0x0000000000000702ull, 0x0000000000070200ull, 0x0000000000070201ull, 0x0000000007020100ull,
+		0x0000000000000703ull, 0x0000000000070300ull, 0x0000000000070301ull, 0x0000000007030100ull,
+		0x0000000000070302ull, 0x0000000007030200ull, 0x0000000007030201ull, 0x0000000703020100ull,
+		0x0000000000000704ull, 0x0000000000070400ull, 0x0000000000070401ull, 0x0000000007040100ull,
+		0x0000000000070402ull, 0x0000000007040200ull, 0x0000000007040201ull, 0x0000000704020100ull,
+		0x0000000000070403ull, 0x0000000007040300ull, 0x0000000007040301ull, 0x0000000704030100ull,
+		0x0000000007040302ull, 0x0000000704030200ull, 0x0000000704030201ull, 0x0000070403020100ull,
+		0x0000000000000705ull, 0x0000000000070500ull, 0x0000000000070501ull, 0x0000000007050100ull,
+		0x0000000000070502ull, 0x0000000007050200ull, 0x0000000007050201ull, 0x0000000705020100ull,
+		0x0000000000070503ull, 0x0000000007050300ull, 0x0000000007050301ull, 0x0000000705030100ull,
+		0x0000000007050302ull, 0x0000000705030200ull, 0x0000000705030201ull, 0x0000070503020100ull,
+		0x0000000000070504ull, 0x0000000007050400ull, 0x0000000007050401ull, 0x0000000705040100ull,
+		0x0000000007050402ull, 0x0000000705040200ull, 0x0000000705040201ull, 0x0000070504020100ull,
+		0x0000000007050403ull, 0x0000000705040300ull, 0x0000000705040301ull, 0x0000070504030100ull,
+		0x0000000705040302ull, 0x0000070504030200ull, 0x0000070504030201ull, 0x0007050403020100ull,
+		0x0000000000000706ull, 0x0000000000070600ull, 0x0000000000070601ull, 0x0000000007060100ull,
+		0x0000000000070602ull, 0x0000000007060200ull, 0x0000000007060201ull, 0x0000000706020100ull,
+		0x0000000000070603ull, 0x0000000007060300ull, 0x0000000007060301ull, 0x0000000706030100ull,
+		0x0000000007060302ull, 0x0000000706030200ull, 0x0000000706030201ull, 0x0000070603020100ull,
+		0x0000000000070604ull, 0x0000000007060400ull, 0x0000000007060401ull, 0x0000000706040100ull,
+		0x0000000007060402ull, 0x0000000706040200ull, 0x0000000706040201ull, 0x0000070604020100ull,
+		0x0000000007060403ull, 0x0000000706040300ull, 0x0000000706040301ull, 0x0000070604030100ull,
+		0x0000000706040302ull, 0x0000070604030200ull, 0x0000070604030201ull, 0x0007060403020100ull,
+		0x0000000000070605ull, 0x0000000007060500ull, 0x0000000007060501ull, 0x0000000706050100ull,
+		0x0000000007060502ull, 0x0000000706050200ull, 0x0000000706050201ull, 0x0000070605020100ull,
+		0x0000000007060503ull, 0x0000000706050300ull, 0x0000000706050301ull, 0x0000070605030100ull,
+		0x0000000706050302ull, 0x0000070605030200ull, 0x0000070605030201ull, 0x0007060503020100ull,
+		0x0000000007060504ull, 0x0000000706050400ull, 0x0000000706050401ull, 0x0000070605040100ull,
+		0x0000000706050402ull, 0x0000070605040200ull, 0x0000070605040201ull, 0x0007060504020100ull,
+		0x0000000706050403ull, 0x0000070605040300ull, 0x0000070605040301ull, 0x0007060504030100ull,
+		0x0000070605040302ull, 0x0007060504030200ull, 0x0007060504030201ull, 0x0706050403020100ull
+	};
+	return lanes;
+}
+
+// Same, for 4 lanes of 64 bits, expressed as pairs of 32 bit lanes
+inline const unsigned long long* compact_lanes64() {
+	static const unsigned long long lanes[16] = {
+		0x0000000000000000ull, 0x0000000000000100ull, 0x0000000000000302ull, 0x0000000003020100ull,
+		0x0000000000000504ull, 0x0000000005040100ull, 0x0000000005040302ull, 0x0000050403020100ull,
+		0x0000000000000706ull, 0x0000000007060100ull, 0x0000000007060302ull, 0x0000070603020100ull,
+		0x0000000007060504ull, 0x0000070605040100ull, 0x0000070605040302ull, 0x0706050403020100ull
+	};
+	return lanes;
+}
+
+CLINQ_TARGET("avx2")
+inline unsigned keep_mask8(const unsigned char* keep) {
+	__m128i flags = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(keep));
+	return unsigned(_mm_movemask_epi8(_mm_cmpgt_epi8(flags, _mm_setzero_si128())));
+}
+
+CLINQ_TARGET("avx2,popcnt")
+inline std::size_t compact_avx2(const void* in, const unsigned char* keep, std::size_t count, void* out, std::integral_constant<std::size_t, 4>) {
+	const std::int32_t* source = static_cast<const std::int32_t*>(in);
+	std::int32_t* target = static_cast<std::int32_t*>(out);
+	const unsigned long long* lanes = compact_lanes32();
+
+	std::size_t result = 0;
+	std::size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		unsigned mask = keep_mask8(keep + i);
+		__m256i permutation = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(lanes + mask)));
+		__m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + result), _mm256_permutevar8x32_epi32(values, permutation));
+		result += std::size_t(_mm_popcnt_u32(mask));
+	}
+
+	return result + compact_scalar(source + i, keep + i, count - i, target + result);
+}
+
+CLINQ_TARGET("avx2,popcnt")
+inline std::size_t compact_avx2(const void* in, const unsigned char* keep, std::size_t count, void* out, std::integral_constant<std::size_t, 8>) {
+	const std::int64_t* source = static_cast<const std::int64_t*>(in);
+	std::int64_t* target = static_cast<std::int64_t*>(out);
+	const unsigned long long* lanes = compact_lanes64();
+
+	std::size_t result = 0;
+	std::size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		unsigned mask = keep_mask8(keep + i) & 0xf;
+		__m256i permutation = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(lanes + mask)));
+		__m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + result), _mm256_permutevar8x32_epi32(values, permutation));
+		result += std::size_t(_mm_popcnt_u32(mask));
+	}
+
+	return result + compact_scalar(source + i, keep + i, count - i, target + result);
+}
+
+#if defined(CLINQ_SIMD_AVX512)
+
+CLINQ_TARGET("avx512f,popcnt")
+inline std::size_t compact_avx512(const void* in, const unsigned char* keep, std::size_t count, void* out, std::integral_constant<std::size_t, 4>) {
+	const std::int32_t* source = static_cast<const std::int32_t*>(in);
+	std::int32_t* target = static_cast<std::int32_t*>(out);
+
+	std::size_t result = 0;
+	std::size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i flags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keep + i));
+		__mmask16 mask = __mmask16(_mm_movemask_epi8(_mm_cmpgt_epi8(flags, _mm_setzero_si128())));
+		_mm512_mask_compressstoreu_epi32(target + result, mask, _mm512_loadu_si512(source + i));
+		result += std::size_t(_mm_popcnt_u32(mask));
+	}
+
+	return result + compact_scalar(source + i, keep + i, count - i, target + result);
+}
+
+CLINQ_TARGET("avx512f,popcnt")
+inline std::size_t compact_avx512(const void* in, const unsigned char* keep, std::size_t count, void* out, std::integral_constant<std::size_t, 8>) {
+	const std::int64_t* source = static_cast<const std::int64_t*>(in);
+	std::int64_t* target = static_cast<std::int64_t*>(out);
+
+	std::size_t result = 0;
+	std::size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i flags = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(keep + i));
+		__mmask8 mask = __mmask8(_mm_movemask_epi8(_mm_cmpgt_epi8(flags, _mm_setzero_si128())));
+		_mm512_mask_compressstoreu_epi64(target + result, mask, _mm512_loadu_si512(source + i));
+		result += std::size_t(_mm_popcnt_u32(mask));
+	}
+
+	return result + compact_scalar(source + i, keep + i, count - i, target + result);
+}
+
+#endif
+
+#endif
+
+template <typename T, std::size_t SIZE>
+std::size_t compact(const T* in, const unsigned char* keep, std::size_t count, T* out, int, std::integral_constant<std::size_t, SIZE>) {
+	return compact_scalar(in, keep, count, out);
+}
+
+#if defined(CLINQ_SIMD)
+
+template <typename T>
+std::size_t compact(const T* in, const unsigned char* keep, std::size_t count, T* out, int level, std::integral_constant<std::size_t, 4> size) {
+#if defined(CLINQ_SIMD_AVX512)
+	if (level >= simd_avx512)
+		return compact_avx512(in, keep, count, out, size);
+#endif
+	if (level >= simd_avx2)
+		return compact_avx2(in, keep, count, out, size);
+
+	return compact_scalar(in, keep, count, out);
+}
+
+template <typename T>
+std::size_t compact(const T* in, const unsigned char* keep, std::size_t count, T* out, int level, std::integral_constant<std::size_t, 8> size) {
+#if defined(CLINQ_SIMD_AVX512)
+	if (level >= simd_avx512)
+		return compact_avx512(in, keep, count, out, size);
+#endif
+	if (level >= simd_avx2)
+		return compact_avx2(in, keep, count, out, size);
+
+	return compact_scalar(in, keep, count, out);
+}
+
+#endif
+
+// Uses level as the highest instruction set allowed
+template <typename T>
+std::size_t compact(const T* in, const unsigned char* keep, std::size_t count, T* out, int level) {
+	return compact(in, keep, count, out, level, std::integral_constant<std::size_t, sizeof(T)>());
+}
+
+template <typename T>
+std::size_t compact(const T* in, const unsigned char* keep, std::size_t count, T* out) {
+	return compact(in, keep, count, out, simd_level());
+}
+
+
+// Operations for the aggregates
+struct SumOp
+{
+	template <typename A, typename B>
+	CLINQ_CONSTEXPR A operator()(const A& a, const B& b) const {
+		return A(a + b);
+	}
+};
+
+struct MinOp
+{
+	template <typename A, typename B>
+	CLINQ_CONSTEXPR A operator()(const A& a, const B& b) const {
+		return b < a ? A(b) : a;
+	}
+};
+
+struct MaxOp
+{
+	template <typename A, typename B>
+	CLINQ_CONSTEXPR A operator()(const A& a, const B& b) const {
+		return a < b ? A(b) : a;
+	}
+};
+
+// Independent accumulators used by the reductions, so the loop does not depend on the previous iteration and
+// the compiler can keep them in vector registers
+const std::size_t reduce_lanes = 8;
+
+// Selector of the reductions over the values themselves
+struct SameValue
+{
+	template <typename V>
+	CLINQ_CONSTEXPR V& operator()(V& value) const {
+		return value;
+	}
+};
+
+// Folds select(value) of the values in init with op. select is inlined in the loop, so a select() before the
+// aggregate is computed in the same registers, without copying its results to a block first.
+template <typename T, typename ACC, typename OP, typename SELECT>
+CLINQ_INLINE ACC reduce_scalar(T* values, std::size_t count, ACC init, OP op, SELECT& select) {
+	if (count < reduce_lanes) {
+		for (std::size_t i = 0; i < count; ++i)
+			init = op(init, select(values[i]));
+		return init;
+	}
+
+	// The first accumulator starts with init, the others with the following values
+	ACC acc[reduce_lanes];
+	acc[0] = op(init, select(values[0]));
+	for (std::size_t j = 1; j < reduce_lanes; ++j)
+		acc[j] = ACC(select(values[j]));
+
+	std::size_t i = reduce_lanes;
+	for (; i + reduce_lanes <= count; i += reduce_lanes) {
+		for (std::size_t j = 0; j < reduce_lanes; ++j)
+			acc[j] = op(acc[j], select(values[i + j]));
+	}
+
+	ACC result = acc[0];
+	for (std::size_t j = 1; j < reduce_lanes; ++j)
+		result = op(result, acc[j]);
+	for (; i < count; ++i)
+		result = op(result, select(values[i]));
+
+	return result;
+}
+
+#if defined(CLINQ_SIMD)
+
+// Same loop, compiled for AVX2 registers
+template <typename T, typename ACC, typename OP, typename SELECT>
+CLINQ_TARGET("avx2")
+ACC reduce_avx2(T* values, std::size_t count, ACC init, OP op, SELECT& select) {
+	return reduce_scalar(values, count, init, op, select);
+}
+
+#endif
+
+template <typename T, typename ACC, typename OP, typename SELECT>
+ACC reduce(T* values, std::size_t count, ACC init, OP op, SELECT& select) {
+#if defined(CLINQ_SIMD)
+	if (simd_level() >= simd_avx2)
+		return reduce_avx2(values, count, init, op, select);
+#endif
+
+	return reduce_scalar(values, count, init, op, select);
+}
+
+template <typename T, typename ACC, typename OP>
+ACC reduce(T* values, std::size_t count, ACC init, OP op) {
+	SameValue same;
+	return reduce(values, count, init, op, same);
+}
+
+// Elements handled by each step of the block loops. Each step is computed in a local array, that can not alias
+// the source, so the compiler maps it to vector registers without adding overlap checks.
+const std::size_t block_lanes = 16;
+
+// Stores transform(values[i]) in out, for select() over contiguous sources
+template <typename T, typename R, typename TRANSFORM>
+CLINQ_INLINE void transform_scalar(T* values, std::size_t count, R* out, TRANSFORM& transform) {
+	std::size_t i = 0;
+	for (; i + block_lanes <= count; i += block_lanes) {
+		R block[block_lanes];
+		for (std::size_t j = 0; j < block_lanes; ++j)
+			block[j] = transform(values[i + j]);
+		for (std::size_t j = 0; j < block_lanes; ++j)
+			out[i + j] = block[j];
+	}
+	for (; i < count; ++i)
+		out[i] = transform(values[i]);
+}
+
+// Stores 1 in keep[i] when predicate(values[i]) is true, for where() over contiguous sources
+template <typename T, typename PREDICATE>
+CLINQ_INLINE void test_scalar(T* values, std::size_t count, unsigned char* keep, PREDICATE& predicate) {
+	std::size_t i = 0;
+	for (; i + block_lanes <= count; i += block_lanes) {
+		// Kept as int, the width of the lanes of the comparisons, and narrowed to bytes afterwards
+		int block[block_lanes];
+		for (std::size_t j = 0; j < block_lanes; ++j)
+			block[j] = predicate(values[i + j]) ? 1 : 0;
+		for (std::size_t j = 0; j < block_lanes; ++j)
+			keep[i + j] = (unsigned char) block[j];
+	}
+	for (; i < count; ++i)
+		keep[i] = predicate(values[i]) ? 1 : 0;
+}
+
+#if defined(CLINQ_SIMD)
+
+// Same loops, compiled for AVX2 and AVX-512 registers. transform and predicate are inlined in them.
+template <typename T, typename R, typename TRANSFORM>
+CLINQ_TARGET("avx2")
+void transform_avx2(T* values, std::size_t count, R* out, TRANSFORM& transform) {
+	transform_scalar(values, count, out, transform);
+}
+
+template <typename T, typename PREDICATE>
+CLINQ_TARGET("avx2")
+void test_avx2(T* values, std::size_t count, unsigned char* keep, PREDICATE& predicate) {
+	test_scalar(values, count, keep, predicate);
+}
+
+#if defined(CLINQ_SIMD_AVX512)
+
+template <typename T, typename R, typename TRANSFORM>
+CLINQ_TARGET("avx512f")
+void transform_avx512(T* values, std::size_t count, R* out, TRANSFORM& transform) {
+	transform_scalar(values, count, out, transform);
+}
+
+template <typename T, typename PREDICATE>
+CLINQ_TARGET("avx512f")
+void test_avx512(T* values, std::size_t count, unsigned char* keep, PREDICATE& predicate) {
+	test_scalar(values, count, keep, predicate);
+}
+
+#endif
+
+#endif
+
+// Uses level as the highest instruction set allowed
+template <typename T, typename R, typename TRANSFORM>
+void transform_values(T* values, std::size_t count, R* out, TRANSFORM& transform, int level) {
+#if defined(CLINQ_SIMD)
+#if defined(CLINQ_SIMD_AVX512)
+	if (level >= simd_avx512)
+		return transform_avx512(values, count, out, transform);
+#endif
+	if (level >= simd_avx2)
+		return transform_avx2(values, count, out, transform);
+#endif
+
+	transform_scalar(values, count, out, transform);
+}
+
+template <typename T, typename PREDICATE>
+void test_values(T* values, std::size_t count, unsigned char* keep, PREDICATE& predicate, int level) {
+#if defined(CLINQ_SIMD)
+#if defined(CLINQ_SIMD_AVX512)
+	if (level >= simd_avx512)
+		return test_avx512(values, count, keep, predicate);
+#endif
+	if (level >= simd_avx2)
+		return test_avx2(values, count, keep, predicate);
+#endif
+
+	test_scalar(values, count, keep, predicate);
+}
+
+template <typename T, typename R, typename TRANSFORM>
+void transform_values(T* values, std::size_t count, R* out, TRANSFORM& transform) {
+	transform_values(values, count, out, transform, simd_level());
+}
+
+template <typename T, typename PREDICATE>
+void test_values(T* values, std::size_t count, unsigned char* keep, PREDICATE& predicate) {
+	test_values(values, count, keep, predicate, simd_level());
+}
+
+// How many elements an enumerator will still return: the exact count or an upper bound
+struct SizeHint
+{
+	std::size_t size;
+	bool exact;
+
+	CLINQ_CONSTEXPR SizeHint(std::size_t size, bool exact)
+		: size(size),
+		  exact(exact) {
+	}
+
+	CLINQ_CONSTEXPR static SizeHint unknown() {
+		return SizeHint(std::numeric_limits<std::size_t>::max(), false);
+	}
+
+	CLINQ_CONSTEXPR bool known() const {
+		return size != std::numeric_limits<std::size_t>::max();
+	}
+};
+
+
+// Reserves room for count more elements, if the container supports it
+template <typename LIST>
+auto reserve(LIST& l, std::size_t count, int) -> decltype(l.reserve(count), void()) {
+	l.reserve(l.size() + count);
+}
+
+template <typename LIST>
+void reserve(LIST&, std::size_t, long) {
+}
+
+
 template <typename ITERATOR>
 struct iterator_traits
 {
 	typedef decltype(*std::declval<ITERATOR>()) value_type;
 };
 
-template <typename ITERATOR>
-class Enumerator
-{
-	bool first;
-	ITERATOR current;
-	ITERATOR end;
+// Forward iterators keep a copy of the current position and move following ahead of it. Input iterators
+// can not be copied to go back, so following is the current position and is moved only on the next read.
+template <typename ITERATOR>
+class Enumerator
+{
+	ITERATOR current;
+	ITERATOR following;
+	ITERATOR end;
+	bool pending;
+
+	Enumerator(const Enumerator& other);
+	Enumerator& operator=(const Enumerator& other);
+
+public:
+
+	typedef typename iterator_traits<ITERATOR>::value_type value_type;
+
+	CLINQ_CONSTEXPR Enumerator(ITERATOR&& begin, ITERATOR&& end)
+		: current(begin),
+		  following(std::move(begin)),
+		  end(std::move(end)),
+		  pending(false) {
+	}
+
+	CLINQ_CONSTEXPR Enumerator(Enumerator&& other)
+		: current(std::move(other.current)),
+		  following(std::move(other.following)),
+		  end(std::move(other.end)),
+		  pending(other.pending) {
+	}
+
+	CLINQ_CONSTEXPR bool next() {
+		return next(category());
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return get(category());
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		return push(sink, category());
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return size_hint(category());
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		return batch(out, max, category());
+	}
+
+	// Only available for random access iterators
+
+	CLINQ_CONSTEXPR std::size_t remaining() const {
+		return std::size_t(end - following);
+	}
+
+	CLINQ_CONSTEXPR Enumerator slice(std::size_t from, std::size_t to) const {
+		typedef typename std::iterator_traits<ITERATOR>::difference_type difference_type;
+
+		return Enumerator(following + difference_type(from), following + difference_type(to));
+	}
+
+	CLINQ_CONSTEXPR ITERATOR position() const {
+		return following;
+	}
+
+	// Element i after the current position, without moving
+	CLINQ_CONSTEXPR value_type at(std::size_t i) const {
+		typedef typename std::iterator_traits<ITERATOR>::difference_type difference_type;
+
+		return following[difference_type(i)];
+	}
+
+	// Skips up to count elements, returns how many were skipped. get() is invalid until next() is called.
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		typedef typename std::iterator_traits<ITERATOR>::difference_type difference_type;
+
+		count = std::min(count, remaining());
+		following += difference_type(count);
+		return count;
+	}
+
+private:
+
+	typedef typename std::iterator_traits<ITERATOR>::iterator_category category;
+
+	CLINQ_CONSTEXPR bool next(std::forward_iterator_tag) {
+		if (following == end)
+			return false;
+
+		current = following;
+		++following;
+		return true;
+	}
+
+	CLINQ_CONSTEXPR bool next(std::input_iterator_tag) {
+		if (pending)
+			++following;
+
+		pending = following != end;
+		return pending;
+	}
+
+	CLINQ_CONSTEXPR value_type get(std::forward_iterator_tag) {
+		return *current;
+	}
+
+	CLINQ_CONSTEXPR value_type get(std::input_iterator_tag) {
+		return *following;
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink, std::forward_iterator_tag) {
+		// Local copies, so the loop does not go through this
+		ITERATOR it = following;
+		ITERATOR last = end;
+		for (; it != last; ++it) {
+			if (!sink(*it)) {
+				current = it;
+				following = ++it;
+				return false;
+			}
+		}
+
+		following = it;
+		return true;
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink, std::input_iterator_tag) {
+		if (pending) {
+			++following;
+			pending = false;
+		}
+
+		for (; following != end; ++following) {
+			if (!sink(*following)) {
+				pending = true;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint(std::random_access_iterator_tag) const {
+		return SizeHint(remaining(), true);
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint(std::input_iterator_tag) const {
+		return SizeHint::unknown();
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::random_access_iterator_tag) {
+		typedef typename std::iterator_traits<ITERATOR>::difference_type difference_type;
+
+		std::size_t count = std::min(max, remaining());
+		for (std::size_t i = 0; i < count; ++i)
+			out[i] = storage<value_type>::store(following[difference_type(i)]);
+
+		following += difference_type(count);
+		return count;
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::forward_iterator_tag) {
+		std::size_t count = 0;
+		for (; count < max && following != end; ++following)
+			out[count++] = storage<value_type>::store(*following);
+
+		return count;
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::input_iterator_tag) {
+		if (pending) {
+			++following;
+			pending = false;
+		}
+
+		std::size_t count = 0;
+		for (; count < max && following != end; ++following) {
+			out[count++] = storage<value_type>::store(*following);
+
+			// References into an input iterator are only valid until it moves, so they are returned one at a time
+			if (std::is_reference<value_type>::value) {
+				pending = true;
+				break;
+			}
+		}
+
+		return count;
+	}
+};
+
+
+// Enumerators that can be split in independent ranges, to be consumed by ParallelQuery
+template <typename ENUMERATOR>
+struct is_splittable : std::false_type
+{
+};
+
+template <typename ITERATOR>
+struct is_splittable<Enumerator<ITERATOR>>
+	: std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<ITERATOR>::iterator_category>
+{
+};
+
+
+// Enumerators that do not filter and can jump over elements with advance()
+template <typename ENUMERATOR>
+struct is_random_access : std::false_type
+{
+};
+
+template <typename ITERATOR>
+struct is_random_access<Enumerator<ITERATOR>> : is_splittable<Enumerator<ITERATOR>>
+{
+};
+
+
+// Enumerators over arrays of numbers, that can be processed by the kernels
+template <typename ENUMERATOR>
+struct is_contiguous : std::false_type
+{
+};
+
+template <typename T>
+struct is_contiguous<Enumerator<T*>> : std::is_arithmetic<T>
+{
+};
+
+
+// Enumerator of func(0) ... func(count - 1), that computes each element when it is read instead of reading it
+// from a container. Slices share copies of func, so it can be called by different threads at the same time.
+template <typename FUNC>
+class IndexEnumerator
+{
+	FUNC func;
+	std::size_t current;
+	std::size_t following;
+	std::size_t end;
+
+	IndexEnumerator(const IndexEnumerator& other);
+	IndexEnumerator& operator=(const IndexEnumerator& other);
+
+public:
+
+	typedef decltype(std::declval<const FUNC&>()(std::size_t())) value_type;
+
+	CLINQ_CONSTEXPR IndexEnumerator(const FUNC& func, std::size_t begin, std::size_t end)
+		: func(func),
+		  current(begin),
+		  following(begin),
+		  end(end) {
+	}
+
+	CLINQ_CONSTEXPR IndexEnumerator(IndexEnumerator&& other)
+		: func(std::move(other.func)),
+		  current(other.current),
+		  following(other.following),
+		  end(other.end) {
+	}
+
+	CLINQ_CONSTEXPR bool next() {
+		if (following == end)
+			return false;
+
+		current = following++;
+		return true;
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return func(current);
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		std::size_t i = following;
+		std::size_t last = end;
+		for (; i != last; ++i) {
+			if (!sink(func(i))) {
+				current = i;
+				following = i + 1;
+				return false;
+			}
+		}
+
+		following = i;
+		return true;
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return SizeHint(remaining(), true);
+	}
+
+	CLINQ_CONSTEXPR std::size_t remaining() const {
+		return end - following;
+	}
+
+	CLINQ_CONSTEXPR IndexEnumerator slice(std::size_t from, std::size_t to) const {
+		return IndexEnumerator(func, following + from, following + to);
+	}
+
+	// Element i after the current position, without moving
+	CLINQ_CONSTEXPR value_type at(std::size_t i) const {
+		return func(following + i);
+	}
+
+	// Skips up to count elements, returns how many were skipped. get() is invalid until next() is called.
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		count = std::min(count, remaining());
+		following += count;
+		return count;
+	}
+};
+
+template <typename FUNC>
+struct is_splittable<IndexEnumerator<FUNC>> : std::true_type
+{
+};
+
+template <typename FUNC>
+struct is_random_access<IndexEnumerator<FUNC>> : std::true_type
+{
+};
+
+// Integer ranges are computed modulo 2^64 with unsigned numbers, so differences and offsets that do not fit in T
+// (range(INT_MIN, INT_MAX)) do not overflow. The results fit in T, so converting them back is exact.
+template <typename T>
+CLINQ_CONSTEXPR T range_value(T begin, T step, std::size_t i, std::true_type /* is_integral */) {
+	return T((unsigned long long) begin + (unsigned long long) i * (unsigned long long) step);
+}
+
+template <typename T>
+CLINQ_CONSTEXPR T range_value(T begin, T step, std::size_t i, std::false_type /* is_integral */) {
+	return T(begin + T(i) * step);
+}
+
+// Element i of range(): computed from the first element, so it does not depend on the previous ones
+template <typename T>
+struct RangeValue
+{
+	T begin;
+	T step;
+
+	CLINQ_CONSTEXPR T operator()(std::size_t i) const {
+		return range_value(begin, step, i, std::is_integral<T>());
+	}
+};
+
+template <typename T>
+CLINQ_CONSTEXPR std::size_t range_size(T begin, T end, T step, std::true_type /* is_integral */) {
+	if (step > T() ? end <= begin : end >= begin)
+		return 0;
+
+	unsigned long long distance = step > T() ? (unsigned long long) end - (unsigned long long) begin
+	                                         : (unsigned long long) begin - (unsigned long long) end;
+	unsigned long long stride = step > T() ? (unsigned long long) step : 0 - (unsigned long long) step;
+	return std::size_t((distance - 1) / stride + 1);
+}
+
+template <typename T>
+CLINQ_CONSTEXPR std::size_t range_size(T begin, T end, T step, std::false_type /* is_integral */) {
+	if (step > T() ? end <= begin : end >= begin)
+		return 0;
+
+	// Rounded up without std::ceil, so it can be used in constant expressions
+	T steps = (end - begin) / step;
+	std::size_t result = std::size_t(steps);
+	return T(result) < steps ? result + 1 : result;
+}
+
+template <typename T>
+struct RepeatValue
+{
+	T value;
+
+	CLINQ_CONSTEXPR T operator()(std::size_t) const {
+		return value;
+	}
+};
+
+
+class no_copy
+{
+	no_copy(const no_copy& other);
+	no_copy& operator=(const no_copy& other);
+
+public:
+	CLINQ_CONSTEXPR no_copy() {
+	}
+};
+
+
+// Empties the storage of an operator, keeping its capacity
+template <typename T>
+void clear_scratch(T& value) {
+	value.clear();
+}
+
+// Storage shared with the results (the groups of group_by) is only reused when nothing else holds it
+template <typename T>
+void clear_scratch(std::shared_ptr<T>& value) {
+	if (value.use_count() == 1)
+		value->clear();
+	else
+		value.reset();
+}
+
+// Storage of the operators of a query, kept by a Plan between its runs. The operators take their slots in the
+// order they are reached from the outermost one, which is the same in all the runs of a plan.
+class PlanScratch : no_copy
+{
+	struct Slot
+	{
+		virtual ~Slot() {
+		}
+	};
+
+	template <typename T>
+	struct SlotOf : Slot
+	{
+		T value;
+	};
+
+	std::vector<std::unique_ptr<Slot>> slots;
+	std::size_t position;
+
+public:
+
+	PlanScratch()
+		: position(0) {
+	}
+
+	PlanScratch(PlanScratch&& other)
+		: slots(std::move(other.slots)),
+		  position(0) {
+	}
+
+	// The following exchanges start again from the first slot
+	void rewind() {
+		position = 0;
+	}
+
+	// Swaps value with the storage kept in the next slot and empties what value receives
+	template <typename T>
+	void exchange(T& value) {
+		if (position == slots.size())
+			slots.push_back(std::unique_ptr<Slot>(new SlotOf<T>()));
+
+		using std::swap;
+		swap(value, static_cast<SlotOf<T>*>(slots[position++].get())->value);
+		clear_scratch(value);
+	}
+};
+
+// Recycle protocol: recycle(scratch) exchanges the storage of an enumerator and of its inner ones with the slots
+// of scratch. Called before the elements are read it lends the storage of the previous run, called after it keeps
+// the storage for the following run.
+template <typename ENUMERATOR>
+auto recycle(ENUMERATOR& enumerator, PlanScratch& scratch, int) -> decltype(enumerator.recycle(scratch)) {
+	return enumerator.recycle(scratch);
+}
+
+template <typename ENUMERATOR>
+void recycle(ENUMERATOR&, PlanScratch&, long) {
+}
+
+template <typename ENUMERATOR>
+void recycle(ENUMERATOR& enumerator, PlanScratch& scratch) {
+	recycle(enumerator, scratch, 0);
+}
+
+
+// Predicates of adjacent where() calls, tested in order
+template <typename FIRST, typename SECOND>
+class BothPredicates
+{
+	FIRST first;
+	SECOND second;
+
+public:
+
+	CLINQ_CONSTEXPR BothPredicates(FIRST&& first, SECOND&& second)
+		: first(std::forward<FIRST>(first)),
+		  second(std::forward<SECOND>(second)) {
+	}
+
+	CLINQ_CONSTEXPR BothPredicates(BothPredicates&& other)
+		: first(std::forward<FIRST>(other.first)),
+		  second(std::forward<SECOND>(other.second)) {
+	}
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		return first(value) && second(value);
+	}
+};
+
+template <typename ENUMERATOR, typename PREDICATE>
+class EnumeratorWithFilter : no_copy
+{
+	ENUMERATOR inner;
+	PREDICATE predicate;
+	// Value tested by next(), so get() does not evaluate inner again
+	holder<typename ENUMERATOR::value_type> current;
+
+	template <typename SINK>
+	struct FilterSink
+	{
+		PREDICATE& predicate;
+		SINK& sink;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			if (!predicate(value))
+				return true;
+
+			return sink(std::forward<V>(value));
+		}
+	};
+
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithFilter(ENUMERATOR&& inner, PREDICATE&& predicate)
+		: inner(std::move(inner)),
+		  predicate(std::forward<PREDICATE>(predicate)) {
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithFilter(EnumeratorWithFilter&& other)
+		: inner(std::move(other.inner)),
+		  predicate(std::forward<PREDICATE>(other.predicate)),
+		  current(std::move(other.current)) {
+	}
+
+	// Tests next after predicate in this enumerator, used by where()
+	template <typename NEXT>
+	CLINQ_CONSTEXPR EnumeratorWithFilter<ENUMERATOR, BothPredicates<PREDICATE, NEXT>> where(NEXT&& next) {
+		return EnumeratorWithFilter<ENUMERATOR, BothPredicates<PREDICATE, NEXT>>(
+			std::move(inner), BothPredicates<PREDICATE, NEXT>(std::forward<PREDICATE>(predicate), std::forward<NEXT>(next))
+		);
+	}
+
+	CLINQ_CONSTEXPR bool next() {
+		while (inner.next()) {
+			current.set(inner.get());
+			if (predicate(current.get()))
+				return true;
+		}
+
+		current.clear();
+		return false;
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return current.get();
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		FilterSink<SINK> filter = { predicate, sink };
+		return detail::push(inner, filter);
+	}
+
+	// Any element can be filtered out
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return SizeHint(inner.size_hint().size, false);
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		typedef storage<value_type> storage_type;
+
+		for (;;) {
+			std::size_t count = detail::next_batch(inner, out, max);
+			if (count < 1)
+				return 0;
+
+			// Branchless compaction, so the loop does not depend on the predicate outcome
+			std::size_t result = 0;
+			for (std::size_t i = 0; i < count; ++i) {
+				bool keep = predicate(storage_type::load(out[i]));
+				out[result] = out[i];
+				result += keep ? 1 : 0;
+			}
+
+			if (result > 0)
+				return result;
+		}
+	}
+
+	// Only available when is_contiguous<ENUMERATOR>: evaluates the predicate for a block and copies the selected values
+	std::size_t next_values(typename simple_type<value_type>::type* out, std::size_t max) {
+		unsigned char keep[batch_size];
+
+		for (;;) {
+			std::size_t count = std::min(std::min(max, batch_size), inner.remaining());
+			if (count < 1)
+				return 0;
+
+			auto values = inner.position();
+			test_values(values, count, keep, predicate);
+			inner.advance(count);
+
+			std::size_t result = compact(values, keep, count, out);
+			if (result > 0)
+				return result;
+		}
+	}
+};
+
+
+// Transforms of adjacent select() calls: second is applied to the result of first
+template <typename FIRST, typename SECOND>
+class ComposedTransform
+{
+	FIRST first;
+	SECOND second;
+
+public:
+
+	CLINQ_CONSTEXPR ComposedTransform(FIRST&& first, SECOND&& second)
+		: first(std::forward<FIRST>(first)),
+		  second(std::forward<SECOND>(second)) {
+	}
+
+	CLINQ_CONSTEXPR ComposedTransform(ComposedTransform&& other)
+		: first(std::forward<FIRST>(other.first)),
+		  second(std::forward<SECOND>(other.second)) {
+	}
+
+	template <typename V>
+	CLINQ_CONSTEXPR auto operator()(V&& value) -> decltype(std::declval<SECOND&>()(std::declval<FIRST&>()(std::forward<V>(value)))) {
+		return second(first(std::forward<V>(value)));
+	}
+};
+
+template <typename ENUMERATOR, typename TRANSFORM>
+class EnumeratorWithTransform : no_copy
+{
+	ENUMERATOR inner;
+	TRANSFORM transform;
+
+	template <typename SINK>
+	struct TransformSink
+	{
+		TRANSFORM& transform;
+		SINK& sink;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			return sink(transform(std::forward<V>(value)));
+		}
+	};
+
+public:
+
+	typedef typename result_of<TRANSFORM(typename ENUMERATOR::value_type)>::type value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithTransform(ENUMERATOR&& inner, TRANSFORM&& transform)
+		: inner(std::move(inner)),
+		  transform(std::forward<TRANSFORM>(transform)) {
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithTransform(EnumeratorWithTransform&& other)
+		: inner(std::move(other.inner)),
+		  transform(std::forward<TRANSFORM>(other.transform)) {
+	}
+
+	// Applies next to the results of transform in this enumerator, used by select()
+	template <typename NEXT>
+	CLINQ_CONSTEXPR EnumeratorWithTransform<ENUMERATOR, ComposedTransform<TRANSFORM, NEXT>> select(NEXT&& next) {
+		return EnumeratorWithTransform<ENUMERATOR, ComposedTransform<TRANSFORM, NEXT>>(
+			std::move(inner), ComposedTransform<TRANSFORM, NEXT>(std::forward<TRANSFORM>(transform), std::forward<NEXT>(next))
+		);
+	}
+
+
+	CLINQ_CONSTEXPR bool next() {
+		return inner.next();
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return transform(inner.get());
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		TransformSink<SINK> transformed = { transform, sink };
+		return detail::push(inner, transformed);
+	}
+
+	CLINQ_CONSTEXPR void limit(std::size_t count) {
+		detail::limit(inner, count);
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return inner.size_hint();
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	// Only available when is_random_access<ENUMERATOR>
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		return inner.advance(count);
+	}
+
+	CLINQ_CONSTEXPR value_type at(std::size_t i) {
+		return transform(inner.at(i));
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		return batch(out, max, std::integral_constant<bool, is_batchable<typename ENUMERATOR::value_type>::value>());
+	}
+
+	// Only available when is_contiguous<ENUMERATOR>
+	std::size_t next_values(typename simple_type<value_type>::type* out, std::size_t max) {
+		std::size_t count = std::min(max, inner.remaining());
+
+		transform_values(inner.position(), count, out, transform);
+		inner.advance(count);
+
+		return count;
+	}
+
+	// Only available when is_contiguous<ENUMERATOR>. Folds up to max results in acc, calling transform inside
+	// the reduction loop, and returns how many were read.
+	template <typename ACC, typename OP>
+	std::size_t reduce_values(ACC& acc, OP op, std::size_t max) {
+		std::size_t count = std::min(max, inner.remaining());
+		acc = reduce(inner.position(), count, acc, op, transform);
+		inner.advance(count);
+
+		return count;
+	}
+
+private:
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::true_type) {
+		return transform_batch<value_type>(inner, transform, out, max);
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::false_type) {
+		return fill_batch(*this, out, max);
+	}
+};
+
+
+template <typename ENUMERATOR, typename TRANSFORM>
+class EnumeratorWithSelectMany : no_copy
+{
+	ENUMERATOR inner;
+	TRANSFORM transform;
+
+public:
+
+	typedef typename result_of<TRANSFORM(typename ENUMERATOR::value_type)>::type list_type;
+	typedef decltype(std::declval<list_type>().begin()) list_iterator_type;
+	typedef typename iterator_traits<list_iterator_type>::value_type value_type;
+
+private:
+
+	typedef Enumerator<list_iterator_type> sub_enumerator_type;
+
+	// References returned by transform are iterated in place, values are kept in one inline slot
+	holder<list_type> list;
+	holder<sub_enumerator_type> sub;
+
+	template <typename SINK>
+	struct SelectManySink
+	{
+		EnumeratorWithSelectMany& owner;
+		SINK& sink;
+
+		template <typename V>
+		bool operator()(V&& value) {
+			owner.expand(std::forward<V>(value));
+			return owner.sub.get().push(sink);
+		}
+	};
+
+	template <typename V>
+	void expand(V&& value) {
+		sub.clear();
+		list.set(transform(std::forward<V>(value)));
+		sub.set(sub_enumerator_type(list.get().begin(), list.get().end()));
+	}
+
+public:
+
+	EnumeratorWithSelectMany(ENUMERATOR&& inner, TRANSFORM&& transform)
+		: inner(std::move(inner)),
+		  transform(std::forward<TRANSFORM>(transform)) {
+	}
+
+	// Only moved before the enumeration starts: iterators into an owned list would not follow it
+	EnumeratorWithSelectMany(EnumeratorWithSelectMany&& other)
+		: inner(std::move(other.inner)),
+		  transform(std::forward<TRANSFORM>(other.transform)) {
+	}
+
+	bool next() {
+		if (!sub.empty() && sub.get().next())
+			return true;
+
+		while (inner.next()) {
+			expand(inner.get());
+			if (sub.get().next())
+				return true;
+		}
+
+		return false;
+	}
+
+	value_type get() {
+		return sub.get().get();
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		if (!sub.empty() && !sub.get().push(sink))
+			return false;
+
+		SelectManySink<SINK> expanding = { *this, sink };
+		return detail::push(inner, expanding);
+	}
+
+	SizeHint size_hint() const {
+		return SizeHint::unknown();
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	// Batches never cross sub lists, because the elements may live inside the current one
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		if (!sub.empty()) {
+			std::size_t count = sub.get().next_batch(out, max);
+			if (count > 0)
+				return count;
+		}
+
+		while (inner.next()) {
+			expand(inner.get());
+
+			std::size_t count = sub.get().next_batch(out, max);
+			if (count > 0)
+				return count;
+		}
+
+		return 0;
+	}
+};
+
+
+template <typename ENUMERATOR>
+class EnumeratorWithTake : no_copy
+{
+	ENUMERATOR inner;
+	std::size_t count;
+
+	template <typename SINK>
+	struct TakeSink
+	{
+		std::size_t& count;
+		SINK& sink;
+		bool stopped;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			--count;
+			if (!sink(std::forward<V>(value))) {
+				stopped = true;
+				return false;
+			}
+
+			return count > 0;
+		}
+	};
+
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithTake(ENUMERATOR&& inner, std::size_t count)
+		: inner(std::move(inner)),
+		  count(count) {
+		detail::limit(this->inner, count);
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithTake(EnumeratorWithTake&& other)
+		: inner(std::move(other.inner)),
+		  count(other.count) {
+	}
+
+	// Keeps the smaller count, used by take()
+	CLINQ_CONSTEXPR EnumeratorWithTake take(std::size_t count) {
+		return EnumeratorWithTake(std::move(inner), std::min(count, this->count));
+	}
+
+	CLINQ_CONSTEXPR bool next() {
+		if (count < 1)
+			return false;
+
+		--count;
+		return inner.next();
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return inner.get();
+	}
+
+	// Stops inner once count elements were pushed, but only reports a stop requested by sink
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		if (count < 1)
+			return true;
+
+		TakeSink<SINK> take = { count, sink, false };
+		detail::push(inner, take);
+		return !take.stopped;
+	}
+
+	CLINQ_CONSTEXPR void limit(std::size_t count) {
+		detail::limit(inner, std::min(count, this->count));
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		SizeHint hint = inner.size_hint();
+		return SizeHint(std::min(hint.size, count), hint.exact);
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		if (count < 1)
+			return 0;
+
+		std::size_t result = detail::next_batch(inner, out, std::min(max, count));
+		count -= result;
+		return result;
+	}
+
+	std::size_t next_values(typename simple_type<value_type>::type* out, std::size_t max) {
+		if (count < 1)
+			return 0;
+
+		std::size_t result = inner.next_values(out, std::min(max, count));
+		count -= result;
+		return result;
+	}
+
+	template <typename ACC, typename OP>
+	std::size_t reduce_values(ACC& acc, OP op, std::size_t max) {
+		std::size_t result = inner.reduce_values(acc, op, std::min(max, count));
+		count -= result;
+		return result;
+	}
+
+	// Only available when is_random_access<ENUMERATOR>
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		std::size_t result = inner.advance(std::min(count, this->count));
+		this->count -= result;
+		return result;
+	}
+
+	CLINQ_CONSTEXPR value_type at(std::size_t i) {
+		return inner.at(i);
+	}
+};
+
+
+template <typename ENUMERATOR>
+class EnumeratorWithSkip : no_copy
+{
+	ENUMERATOR inner;
+	std::size_t count;
+
+	template <typename SINK>
+	struct SkipSink
+	{
+		std::size_t& count;
+		SINK& sink;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			if (count > 0) {
+				--count;
+				return true;
+			}
+
+			return sink(std::forward<V>(value));
+		}
+	};
+
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithSkip(ENUMERATOR&& inner, std::size_t count)
+		: inner(std::move(inner)),
+		  count(count) {
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithSkip(EnumeratorWithSkip&& other)
+		: inner(std::move(other.inner)),
+		  count(other.count) {
+	}
+
+	// Skips both counts, used by skip()
+	CLINQ_CONSTEXPR EnumeratorWithSkip skip(std::size_t count) {
+		std::size_t max = std::numeric_limits<std::size_t>::max();
+		return EnumeratorWithSkip(std::move(inner), count > max - this->count ? max : this->count + count);
+	}
+
+	CLINQ_CONSTEXPR bool next() {
+		if (!skip())
+			return false;
+
+		return inner.next();
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return inner.get();
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		if (is_random_access<ENUMERATOR>::value)
+			skip();
+
+		SkipSink<SINK> skipping = { count, sink };
+		return detail::push(inner, skipping);
+	}
+
+	// The skipped elements are also read from inner
+	CLINQ_CONSTEXPR void limit(std::size_t count) {
+		detail::limit(inner, count > std::numeric_limits<std::size_t>::max() - this->count ? std::numeric_limits<std::size_t>::max() : this->count + count);
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		SizeHint hint = inner.size_hint();
+		if (!hint.known())
+			return hint;
+
+		return SizeHint(hint.size > count ? hint.size - count : 0, hint.exact);
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		if (!skip())
+			return 0;
+
+		return detail::next_batch(inner, out, max);
+	}
+
+	std::size_t next_values(typename simple_type<value_type>::type* out, std::size_t max) {
+		if (!skip())
+			return 0;
+
+		return inner.next_values(out, max);
+	}
+
+	template <typename ACC, typename OP>
+	std::size_t reduce_values(ACC& acc, OP op, std::size_t max) {
+		if (!skip())
+			return 0;
+
+		return inner.reduce_values(acc, op, max);
+	}
+
+	// Only available when is_random_access<ENUMERATOR>
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		skip();
+		return inner.advance(count);
+	}
+
+	CLINQ_CONSTEXPR value_type at(std::size_t i) {
+		skip();
+		return inner.at(i);
+	}
+
+private:
+
+	// Skips the pending elements. Returns false if inner ended before that.
+	CLINQ_CONSTEXPR bool skip() {
+		return skip(std::integral_constant<bool, is_random_access<ENUMERATOR>::value>());
+	}
+
+	CLINQ_CONSTEXPR bool skip(std::true_type) {
+		if (count > 0) {
+			inner.advance(count);
+			count = 0;
+		}
+
+		return true;
+	}
+
+	CLINQ_CONSTEXPR bool skip(std::false_type) {
+		while (count > 0) {
+			if (!inner.next())
+				return false;
+
+			--count;
+		}
+
+		return true;
+	}
+};
+
+
+// Casts done by an EnumeratorWithStaticCast: to each VIA type, in order, and then to T
+template <typename T, typename... VIA>
+struct StaticCasts;
+
+template <typename T>
+struct StaticCasts<T>
+{
+	template <typename V>
+	CLINQ_CONSTEXPR static T apply(V&& value) {
+		return static_cast<T>(std::forward<V>(value));
+	}
+};
+
+template <typename T, typename FIRST, typename... REST>
+struct StaticCasts<T, FIRST, REST...>
+{
+	template <typename V>
+	CLINQ_CONSTEXPR static T apply(V&& value) {
+		return StaticCasts<T, REST...>::apply(static_cast<FIRST>(std::forward<V>(value)));
+	}
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA>
+class EnumeratorWithStaticCast : no_copy
+{
+	ENUMERATOR inner;
+
+	template <typename SINK>
+	struct CastSink
+	{
+		SINK& sink;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			return sink(StaticCasts<T, VIA...>::apply(std::forward<V>(value)));
+		}
+	};
+
+public:
+
+	typedef T value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithStaticCast(ENUMERATOR&& inner)
+		: inner(std::move(inner)) {
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithStaticCast(EnumeratorWithStaticCast&& other)
+		: inner(std::move(other.inner)) {
+	}
+
+	// Adds a cast to U after this one, used by cast_static()
+	template <typename U>
+	CLINQ_CONSTEXPR EnumeratorWithStaticCast<ENUMERATOR, U, VIA..., T> cast_static() {
+		return EnumeratorWithStaticCast<ENUMERATOR, U, VIA..., T>(std::move(inner));
+	}
+
+
+	CLINQ_CONSTEXPR bool next() {
+		return inner.next();
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return StaticCasts<T, VIA...>::apply(inner.get());
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		CastSink<SINK> cast = { sink };
+		return detail::push(inner, cast);
+	}
+
+	CLINQ_CONSTEXPR void limit(std::size_t count) {
+		detail::limit(inner, count);
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return inner.size_hint();
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	// Only available when is_random_access<ENUMERATOR>
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		return inner.advance(count);
+	}
+
+	CLINQ_CONSTEXPR value_type at(std::size_t i) {
+		return cast(inner.at(i));
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		return batch(out, max, std::integral_constant<bool, is_batchable<typename ENUMERATOR::value_type>::value>());
+	}
+
+private:
+
+	CLINQ_CONSTEXPR static value_type cast(typename ENUMERATOR::value_type value) {
+		return StaticCasts<T, VIA...>::apply(value);
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::true_type) {
+		return transform_batch<value_type>(inner, cast, out, max);
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::false_type) {
+		return fill_batch(*this, out, max);
+	}
+};
+
+
+// Casts done by an EnumeratorWithDynamicCast: to each VIA type, in order, and then to T
+template <typename T, typename... VIA>
+struct DynamicCasts;
+
+template <typename T>
+struct DynamicCasts<T>
+{
+	template <typename V>
+	CLINQ_CONSTEXPR static T apply(V&& value) {
+		return dynamic_cast<T>(std::forward<V>(value));
+	}
+};
+
+template <typename T, typename FIRST, typename... REST>
+struct DynamicCasts<T, FIRST, REST...>
+{
+	template <typename V>
+	CLINQ_CONSTEXPR static T apply(V&& value) {
+		return DynamicCasts<T, REST...>::apply(dynamic_cast<FIRST>(std::forward<V>(value)));
+	}
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA>
+class EnumeratorWithDynamicCast : no_copy
+{
+	ENUMERATOR inner;
+
+	template <typename SINK>
+	struct CastSink
+	{
+		SINK& sink;
+
+		template <typename V>
+		CLINQ_CONSTEXPR bool operator()(V&& value) {
+			return sink(DynamicCasts<T, VIA...>::apply(std::forward<V>(value)));
+		}
+	};
+
+public:
+
+	typedef T value_type;
+
+	CLINQ_CONSTEXPR EnumeratorWithDynamicCast(ENUMERATOR&& inner)
+		: inner(std::move(inner)) {
+	}
+
+	CLINQ_CONSTEXPR EnumeratorWithDynamicCast(EnumeratorWithDynamicCast&& other)
+		: inner(std::move(other.inner)) {
+	}
+
+	// Adds a cast to U after this one, used by cast_dynamic()
+	template <typename U>
+	CLINQ_CONSTEXPR EnumeratorWithDynamicCast<ENUMERATOR, U, VIA..., T> cast_dynamic() {
+		return EnumeratorWithDynamicCast<ENUMERATOR, U, VIA..., T>(std::move(inner));
+	}
+
+
+	CLINQ_CONSTEXPR bool next() {
+		return inner.next();
+	}
+
+	CLINQ_CONSTEXPR value_type get() {
+		return DynamicCasts<T, VIA...>::apply(inner.get());
+	}
+
+	template <typename SINK>
+	CLINQ_CONSTEXPR bool push(SINK& sink) {
+		CastSink<SINK> cast = { sink };
+		return detail::push(inner, cast);
+	}
+
+	CLINQ_CONSTEXPR void limit(std::size_t count) {
+		detail::limit(inner, count);
+	}
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return inner.size_hint();
+	}
+
+	void recycle(PlanScratch& scratch) {
+		detail::recycle(inner, scratch);
+	}
+
+	// Only available when is_random_access<ENUMERATOR>
+	CLINQ_CONSTEXPR std::size_t advance(std::size_t count) {
+		return inner.advance(count);
+	}
+
+	CLINQ_CONSTEXPR value_type at(std::size_t i) {
+		return cast(inner.at(i));
+	}
+
+	std::size_t next_batch(typename storage<value_type>::type* out, std::size_t max) {
+		return batch(out, max, std::integral_constant<bool, is_batchable<typename ENUMERATOR::value_type>::value>());
+	}
+
+private:
+
+	CLINQ_CONSTEXPR static value_type cast(typename ENUMERATOR::value_type value) {
+		return DynamicCasts<T, VIA...>::apply(value);
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::true_type) {
+		return transform_batch<value_type>(inner, cast, out, max);
+	}
+
+	std::size_t batch(typename storage<value_type>::type* out, std::size_t max, std::false_type) {
+		return fill_batch(*this, out, max);
+	}
+};
+
+
+// Orders by key(element), for order_by() and order_by_descending()
+template <typename KEY, bool DESCENDING>
+struct KeyComparer
+{
+	KEY key;
+
+	explicit KeyComparer(KEY&& key)
+		: key(std::forward<KEY>(key)) {
+	}
+
+	template <typename A, typename B>
+	bool operator()(A& a, B& b) {
+		if (DESCENDING)
+			return key(b) < key(a);
+		else
+			return key(a) < key(b);
+	}
+};
+
+// Uses NEXT for the elements that are equal for FIRST, for then_by()
+template <typename FIRST, typename NEXT>
+struct ThenComparer
+{
+	FIRST first;
+	NEXT next;
+
+	ThenComparer(FIRST&& first, NEXT&& next)
+		: first(std::move(first)),
+		  next(std::move(next)) {
+	}
+
+	template <typename A, typename B>
+	bool operator()(A& a, B& b) {
+		if (first(a, b))
+			return true;
+		if (first(b, a))
+			return false;
+		return next(a, b);
+	}
+};
+
+
+// Reads all the elements of inner in the first call and returns them in order. The order is stable.
+// After limit(count) only the first count elements are kept, in a heap.
+template <typename ENUMERATOR, typename COMPARER>
+class EnumeratorWithOrder : no_copy
+{
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+
+private:
+
+	typedef storage<value_type> storage_type;
+	typedef typename storage_type::type item_type;
+
+	// The position in the source breaks ties, so the heap keeps the order stable
+	struct Candidate
+	{
+		item_type item;
+		std::size_t index;
+
+		Candidate(item_type&& item, std::size_t index)
+			: item(std::move(item)),
+			  index(index) {
+		}
+
+		Candidate(Candidate&& other)
+			: item(std::move(other.item)),
+			  index(other.index) {
+		}
+
+		Candidate& operator=(Candidate&& other) {
+			item = std::move(other.item);
+			index = other.index;
+			return *this;
+		}
+	};
+
+	// The algorithms may pass const elements, but the keys receive the same references as get() returns
+	struct ItemLess
+	{
+		COMPARER* comparer;
+
+		bool operator()(const item_type& a, const item_type& b) const {
+			return (*comparer)(storage_type::load(const_cast<item_type&>(a)), storage_type::load(const_cast<item_type&>(b)));
+		}
+	};
+
+	struct CandidateLess
+	{
+		COMPARER* comparer;
+
+		bool operator()(const Candidate& a, const Candidate& b) const {
+			ItemLess less = { comparer };
+			if (less(a.item, b.item))
+				return true;
+			if (less(b.item, a.item))
+				return false;
+			return a.index < b.index;
+		}
+	};
+
+	struct AllSink
+	{
+		std::vector<item_type>& items;
+
+		bool operator()(value_type value) {
+			items.push_back(storage_type::store(std::forward<value_type>(value)));
+			return true;
+		}
+	};
+
+	struct TopSink
+	{
+		EnumeratorWithOrder& owner;
+		std::vector<Candidate>& heap;
+		std::size_t index;
+
+		bool operator()(value_type value) {
+			CandidateLess less = { &owner.comparer };
+
+			if (heap.size() < owner.count) {
+				heap.push_back(Candidate(storage_type::store(std::forward<value_type>(value)), index++));
+				std::push_heap(heap.begin(), heap.end(), less);
+
+			} else {
+				// heap.front() is the last of the candidates, and value comes after it in the source
+				if (owner.comparer(value, storage_type::load(heap.front().item))) {
+					std::pop_heap(heap.begin(), heap.end(), less);
+					heap.back() = Candidate(storage_type::store(std::forward<value_type>(value)), index);
+					std::push_heap(heap.begin(), heap.end(), less);
+				}
+				index++;
+			}
+
+			return true;
+		}
+	};
+
+	ENUMERATOR inner;
+	COMPARER comparer;
+	std::size_t count;
+	bool sorted;
+	std::vector<item_type> items;
+	std::vector<Candidate> heap;
+	std::size_t current;
+	std::size_t following;
+
+public:
+
+	EnumeratorWithOrder(ENUMERATOR&& inner, COMPARER&& comparer)
+		: inner(std::move(inner)),
+		  comparer(std::move(comparer)),
+		  count(std::numeric_limits<std::size_t>::max()),
+		  sorted(false),
+		  current(0),
+		  following(0) {
+	}
+
+	EnumeratorWithOrder(EnumeratorWithOrder&& other)
+		: inner(std::move(other.inner)),
+		  comparer(std::move(other.comparer)),
+		  count(other.count),
+		  sorted(other.sorted),
+		  items(std::move(other.items)),
+		  heap(std::move(other.heap)),
+		  current(other.current),
+		  following(other.following) {
+	}
+
+	bool next() {
+		sort();
+
+		if (following >= items.size())
+			return false;
+
+		current = following++;
+		return true;
+	}
+
+	value_type get() {
+		return storage_type::load(items[current]);
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		sort();
+
+		while (following < items.size()) {
+			current = following++;
+			if (!sink(storage_type::release(items[current])))
+				return false;
+		}
+
+		return true;
+	}
+
+	SizeHint size_hint() const {
+		SizeHint hint = inner.size_hint();
+		return SizeHint(std::min(hint.size, count), hint.exact);
+	}
+
+	void limit(std::size_t count) {
+		this->count = std::min(this->count, count);
+	}
+
+	void recycle(PlanScratch& scratch) {
+		scratch.exchange(items);
+		scratch.exchange(heap);
+		detail::recycle(inner, scratch);
+	}
+
+	// Adds a comparer for the elements that are equal, used by then_by()
+	template <typename NEXT>
+	EnumeratorWithOrder<ENUMERATOR, ThenComparer<COMPARER, NEXT>> then(NEXT&& next) {
+		return EnumeratorWithOrder<ENUMERATOR, ThenComparer<COMPARER, NEXT>>(
+			std::move(inner), ThenComparer<COMPARER, NEXT>(std::move(comparer), std::move(next))
+		);
+	}
+
+private:
+
+	void sort() {
+		if (sorted)
+			return;
+		sorted = true;
+
+		SizeHint hint = inner.size_hint();
+		if (hint.exact && hint.size <= count)
+			sort_all(hint.size);
+		else if (count > 0)
+			sort_top(hint);
+	}
+
+	void sort_all(std::size_t size) {
+		items.reserve(size);
+
+		AllSink sink = { items };
+		detail::push(inner, sink);
+
+		ItemLess less = { &comparer };
+		std::stable_sort(items.begin(), items.end(), less);
+	}
+
+	// Bounded heap with the best count elements: O(n log count) time and O(count) memory
+	void sort_top(SizeHint hint) {
+		if (hint.exact)
+			heap.reserve(std::min(hint.size, count));
+
+		TopSink sink = { *this, heap, 0 };
+		detail::push(inner, sink);
+
+		CandidateLess less = { &comparer };
+		std::sort_heap(heap.begin(), heap.end(), less);
+
+		items.reserve(heap.size());
+		for (std::size_t i = 0; i < heap.size(); ++i)
+			items.push_back(std::move(heap[i].item));
+		heap.clear();
+	}
+};
+
+// then_by() is only available after order_by(), order_by_descending() or then_by()
+template <typename ENUMERATOR, typename NEXT>
+struct then_by_enumerator;
+
+template <typename ENUMERATOR, typename COMPARER, typename NEXT>
+struct then_by_enumerator<EnumeratorWithOrder<ENUMERATOR, COMPARER>, NEXT>
+{
+	typedef EnumeratorWithOrder<ENUMERATOR, ThenComparer<COMPARER, NEXT>> type;
+};
+
+
+// Hash table with open addressing (linear probing). The keys are kept in insertion order in a vector and
+// the slots only keep the hash and the position of the key, so probing reads a small contiguous array.
+template <typename KEY, typename HASH = std::hash<KEY>, typename EQUAL = std::equal_to<KEY>>
+class FlatTable : no_copy
+{
+	struct Slot
+	{
+		std::size_t hash;
+		// Position of the key + 1, 0 for empty slots
+		std::size_t index;
+	};
+
+	// Wrapped, so bool keys are not packed by std::vector<bool>
+	struct Key
+	{
+		KEY value;
+
+		explicit Key(const KEY& value)
+			: value(value) {
+		}
+
+		explicit Key(KEY&& value)
+			: value(std::move(value)) {
+		}
+
+		Key(Key&& other)
+			: value(std::move(other.value)) {
+		}
+	};
+
+	std::vector<Slot> slots;
+	std::vector<Key> keys;
+	HASH hasher;
+	EQUAL equal;
+
+public:
+
+	static const std::size_t npos = std::size_t(-1);
+
+	FlatTable() {
+	}
+
+	FlatTable(FlatTable&& other)
+		: slots(std::move(other.slots)),
+		  keys(std::move(other.keys)),
+		  hasher(std::move(other.hasher)),
+		  equal(std::move(other.equal)) {
+	}
+
+	std::size_t size() const {
+		return keys.size();
+	}
+
+	KEY& key(std::size_t index) {
+		return keys[index].value;
+	}
+
+	// Removes all the keys, keeping the allocated memory
+	void clear() {
+		keys.clear();
+		std::fill(slots.begin(), slots.end(), Slot());
+	}
+
+	friend void swap(FlatTable& a, FlatTable& b) {
+		using std::swap;
+		a.slots.swap(b.slots);
+		a.keys.swap(b.keys);
+		swap(a.hasher, b.hasher);
+		swap(a.equal, b.equal);
+	}
+
+	void reserve(std::size_t count) {
+		keys.reserve(count);
+		if (count * 4 > slots.size() * 3)
+			rehash(capacity_for(count));
+	}
+
+	// Position of key, or npos
+	std::size_t find(const KEY& key) const {
+		if (slots.empty())
+			return npos;
+
+		std::size_t hash = hash_of(key);
+		std::size_t mask = slots.size() - 1;
+		for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+			const Slot& slot = slots[i];
+			if (slot.index == 0)
+				return npos;
+			if (slot.hash == hash && equal(keys[slot.index - 1].value, key))
+				return slot.index - 1;
+		}
+	}
+
+	// Position of key, adding it at the end if it is not in the table
+	template <typename K>
+	std::size_t insert(K&& key, bool& inserted) {
+		if ((keys.size() + 1) * 4 > slots.size() * 3)
+			rehash(capacity_for(keys.size() + 1));
+
+		std::size_t hash = hash_of(key);
+		std::size_t mask = slots.size() - 1;
+		for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+			Slot& slot = slots[i];
+			if (slot.index == 0) {
+				keys.push_back(Key(std::forward<K>(key)));
+				slot.hash = hash;
+				slot.index = keys.size();
+				inserted = true;
+				return keys.size() - 1;
+			}
+			if (slot.hash == hash && equal(keys[slot.index - 1].value, key)) {
+				inserted = false;
+				return slot.index - 1;
+			}
+		}
+	}
+
+private:
+
+	// std::hash is the identity for integers in most libraries: mix the bits, so the low ones can be used
+	std::size_t hash_of(const KEY& key) const {
+		std::uint64_t hash = std::uint64_t(hasher(key)) * 0x9E3779B97F4A7C15ull;
+		return std::size_t(hash ^ (hash >> 32));
+	}
+
+	static std::size_t capacity_for(std::size_t count) {
+		std::size_t capacity = 16;
+		while (capacity * 3 < count * 4)
+			capacity *= 2;
+		return capacity;
+	}
+
+	void rehash(std::size_t capacity) {
+		std::vector<Slot> old(capacity);
+		old.swap(slots);
+
+		std::size_t mask = capacity - 1;
+		for (std::size_t i = 0; i < old.size(); ++i) {
+			if (old[i].index == 0)
+				continue;
+
+			std::size_t j = old[i].hash & mask;
+			while (slots[j].index != 0)
+				j = (j + 1) & mask;
+			slots[j] = old[i];
+		}
+	}
+};
+
+
+// Elements added with a key. After finish() the elements with the same key are contiguous, in the order they were
+// added, and the keys are numbered in the order they first appeared.
+template <typename KEY, typename ITEM>
+class KeyedItems : no_copy
+{
+	FlatTable<KEY> table;
+	std::vector<ITEM> items;
+	// Before finish(): elements per key. After: position of the first element of each key, and the end.
+	std::vector<std::size_t> offsets;
+	// Key of each element, and its final position inside finish()
+	std::vector<std::size_t> key_of;
+
+public:
+
+	static const std::size_t npos = FlatTable<KEY>::npos;
+
+	KeyedItems() {
+	}
+
+	KeyedItems(KeyedItems&& other)
+		: table(std::move(other.table)),
+		  items(std::move(other.items)),
+		  offsets(std::move(other.offsets)),
+		  key_of(std::move(other.key_of)) {
+	}
+
+	// Removes all the elements and keys, keeping the allocated memory
+	void clear() {
+		table.clear();
+		items.clear();
+		offsets.clear();
+		key_of.clear();
+	}
+
+	friend void swap(KeyedItems& a, KeyedItems& b) {
+		swap(a.table, b.table);
+		a.items.swap(b.items);
+		a.offsets.swap(b.offsets);
+		a.key_of.swap(b.key_of);
+	}
+
+	void reserve(std::size_t count) {
+		items.reserve(count);
+		key_of.reserve(count);
+	}
+
+	// Number of the key, to be used in add()
+	template <typename K>
+	std::size_t add_key(K&& key) {
+		bool inserted;
+		std::size_t index = table.insert(std::forward<K>(key), inserted);
+		if (inserted)
+			offsets.push_back(0);
+		return index;
+	}
+
+	void add(std::size_t key, ITEM&& item) {
+		offsets[key]++;
+		key_of.push_back(key);
+		items.push_back(std::move(item));
+	}
+
+	// Counting sort by key, in place, so it does not allocate
+	void finish() {
+		std::size_t total = 0;
+		for (std::size_t i = 0; i < offsets.size(); ++i) {
+			std::size_t count = offsets[i];
+			offsets[i] = total;
+			total += count;
+		}
+		offsets.push_back(total);
+
+		for (std::size_t i = 0; i < key_of.size(); ++i)
+			key_of[i] = offsets[key_of[i]]++;
+
+		// Each position was moved to the start of the following key
+		for (std::size_t i = offsets.size() - 1; i > 0; --i)
+			offsets[i] = offsets[i - 1];
+		offsets[0] = 0;
+
+		// Each swap moves one element to its final position
+		using std::swap;
+		for (std::size_t i = 0; i < items.size(); ++i) {
+			while (key_of[i] != i) {
+				std::size_t position = key_of[i];
+				swap(items[i], items[position]);
+				swap(key_of[i], key_of[position]);
+			}
+		}
+
+		key_of.clear();
+	}
+
+	// Number of keys
+	std::size_t size() const {
+		return table.size();
+	}
+
+	KEY& key(std::size_t index) {
+		return table.key(index);
+	}
+
+	std::size_t find(const KEY& key) const {
+		return table.find(key);
+	}
+
+	ITEM* begin(std::size_t key) {
+		return items.data() + offsets[key];
+	}
+
+	ITEM* end(std::size_t key) {
+		return items.data() + offsets[key + 1];
+	}
+};
+
+
+// Random access iterator over stored references (pointers), that returns the referenced elements
+template <typename T>
+class indirect_iterator
+{
+	T* const* position;
+
+public:
+
+	typedef std::random_access_iterator_tag iterator_category;
+	typedef typename std::remove_cv<T>::type value_type;
+	typedef T& reference;
+	typedef T* pointer;
+	typedef std::ptrdiff_t difference_type;
+
+	indirect_iterator()
+		: position(nullptr) {
+	}
+
+	explicit indirect_iterator(T* const* position)
+		: position(position) {
+	}
+
+	T& operator*() const {
+		return **position;
+	}
+
+	T* operator->() const {
+		return *position;
+	}
+
+	T& operator[](difference_type n) const {
+		return *position[n];
+	}
+
+	indirect_iterator& operator++() {
+		++position;
+		return *this;
+	}
+
+	indirect_iterator operator++(int) {
+		return indirect_iterator(position++);
+	}
+
+	indirect_iterator& operator--() {
+		--position;
+		return *this;
+	}
+
+	indirect_iterator operator--(int) {
+		return indirect_iterator(position--);
+	}
+
+	indirect_iterator& operator+=(difference_type n) {
+		position += n;
+		return *this;
+	}
+
+	indirect_iterator& operator-=(difference_type n) {
+		position -= n;
+		return *this;
+	}
+
+	indirect_iterator operator+(difference_type n) const {
+		return indirect_iterator(position + n);
+	}
+
+	friend indirect_iterator operator+(difference_type n, const indirect_iterator& it) {
+		return it + n;
+	}
+
+	indirect_iterator operator-(difference_type n) const {
+		return indirect_iterator(position - n);
+	}
+
+	difference_type operator-(const indirect_iterator& other) const {
+		return position - other.position;
+	}
+
+	bool operator==(const indirect_iterator& other) const {
+		return position == other.position;
+	}
+
+	bool operator!=(const indirect_iterator& other) const {
+		return position != other.position;
+	}
+
+	bool operator<(const indirect_iterator& other) const {
+		return position < other.position;
+	}
+
+	bool operator>(const indirect_iterator& other) const {
+		return position > other.position;
+	}
+
+	bool operator<=(const indirect_iterator& other) const {
+		return position <= other.position;
+	}
+
+	bool operator>=(const indirect_iterator& other) const {
+		return position >= other.position;
+	}
+};
+
+// Iterator over an array of stored elements: values are iterated directly, references through the pointers
+template <typename T>
+struct stored_iterator
+{
+	typedef typename storage<T>::type* type;
+
+	static type make(typename storage<T>::type* position) {
+		return position;
+	}
+};
+
+template <typename T>
+struct stored_iterator<T&>
+{
+	typedef indirect_iterator<T> type;
+
+	static type make(T** position) {
+		return type(position);
+	}
+};
+
+
+// Elements with the same key, returned by group_by(). The elements of all the groups are kept in one array,
+// shared by the groups, so a group can outlive the query.
+template <typename KEY, typename ELEMENT>
+class Grouping
+{
+	typedef typename storage<ELEMENT>::type item_type;
+
+	std::shared_ptr<void> owner;
+	const KEY* group_key;
+	item_type* first;
+	item_type* last;
+
+public:
+
+	typedef typename stored_iterator<ELEMENT>::type iterator;
+
+	Grouping(const std::shared_ptr<void>& owner, const KEY* key, item_type* first, item_type* last)
+		: owner(owner),
+		  group_key(key),
+		  first(first),
+		  last(last) {
+	}
+
+	const KEY& key() const {
+		return *group_key;
+	}
+
+	std::size_t size() const {
+		return std::size_t(last - first);
+	}
+
+	iterator begin() const {
+		return stored_iterator<ELEMENT>::make(first);
+	}
+
+	iterator end() const {
+		return stored_iterator<ELEMENT>::make(last);
+	}
+};
+
+// Returns the element itself, for group_by(key)
+struct SameElement
+{
+	template <typename T>
+	T&& operator()(T&& value) const {
+		return std::forward<T>(value);
+	}
+};
+
+// Type kept for the result of a selector: rvalue references are kept as values
+template <typename T>
+struct selected_type
+{
+	typedef typename std::conditional<std::is_rvalue_reference<T>::value, typename std::remove_reference<T>::type, T>::type type;
+};
+
+
+// Reads all the elements of inner in the first call and returns one group per key, in the order the keys appear
+template <typename ENUMERATOR, typename KEY_SELECTOR, typename ELEMENT_SELECTOR>
+class EnumeratorWithGroup : no_copy
+{
+public:
+
+	typedef typename simple_type<typename result_of<KEY_SELECTOR(typename ENUMERATOR::value_type&)>::type>::type key_type;
+	typedef typename selected_type<typename result_of<ELEMENT_SELECTOR(typename ENUMERATOR::value_type)>::type>::type element_type;
+	typedef Grouping<key_type, element_type>& value_type;
+
+private:
+
+	typedef storage<element_type> element_storage;
+	typedef typename element_storage::type item_type;
+
+	typedef KeyedItems<key_type, item_type> Groups;
+
+	struct GroupSink
+	{
+		EnumeratorWithGroup& owner;
+		Groups& groups;
+
+		bool operator()(typename ENUMERATOR::value_type value) {
+			std::size_t key = groups.add_key(owner.key(value));
+			groups.add(key, element_storage::store(owner.element(std::forward<typename ENUMERATOR::value_type>(value))));
+			return true;
+		}
+	};
+
+	ENUMERATOR inner;
+	KEY_SELECTOR key;
+	ELEMENT_SELECTOR element;
+	bool grouped;
+	std::shared_ptr<Groups> data;
+	std::vector<Grouping<key_type, element_type>> groups;
+	std::size_t current;
+	std::size_t following;
+
+public:
+
+	EnumeratorWithGroup(ENUMERATOR&& inner, KEY_SELECTOR&& key, ELEMENT_SELECTOR&& element)
+		: inner(std::move(inner)),
+		  key(std::forward<KEY_SELECTOR>(key)),
+		  element(std::forward<ELEMENT_SELECTOR>(element)),
+		  grouped(false),
+		  current(0),
+		  following(0) {
+	}
+
+	EnumeratorWithGroup(EnumeratorWithGroup&& other)
+		: inner(std::move(other.inner)),
+		  key(std::forward<KEY_SELECTOR>(other.key)),
+		  element(std::forward<ELEMENT_SELECTOR>(other.element)),
+		  grouped(other.grouped),
+		  data(std::move(other.data)),
+		  groups(std::move(other.groups)),
+		  current(other.current),
+		  following(other.following) {
+	}
+
+	bool next() {
+		group();
+
+		if (following >= groups.size())
+			return false;
+
+		current = following++;
+		return true;
+	}
+
+	value_type get() {
+		return groups[current];
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		group();
+
+		while (following < groups.size()) {
+			current = following++;
+			if (!sink(groups[current]))
+				return false;
+		}
+
+		return true;
+	}
+
+	// There are at most as many groups as elements
+	SizeHint size_hint() const {
+		return SizeHint(inner.size_hint().size, false);
+	}
+
+	// The groups go first, so the ones kept from the previous run release the elements before they are reused
+	void recycle(PlanScratch& scratch) {
+		scratch.exchange(groups);
+		scratch.exchange(data);
+		detail::recycle(inner, scratch);
+	}
+
+private:
+
+	void group() {
+		if (grouped)
+			return;
+		grouped = true;
+
+		if (!data)
+			data = std::make_shared<Groups>();
+
+		SizeHint hint = inner.size_hint();
+		if (hint.exact)
+			data->reserve(hint.size);
+
+		GroupSink sink = { *this, *data };
+		detail::push(inner, sink);
+		data->finish();
+
+		groups.reserve(data->size());
+		for (std::size_t i = 0; i < data->size(); ++i)
+			groups.push_back(Grouping<key_type, element_type>(data, &data->key(i), data->begin(i), data->end(i)));
+	}
+};
+
+
+// Returns the first element for each key, keeping the keys already seen in a FlatTable
+template <typename ENUMERATOR, typename KEY_SELECTOR>
+class EnumeratorWithDistinct : no_copy
+{
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+	typedef typename simple_type<typename result_of<KEY_SELECTOR(value_type&)>::type>::type key_type;
+
+private:
+
+	template <typename SINK>
+	struct DistinctSink
+	{
+		EnumeratorWithDistinct& owner;
+		SINK& sink;
+
+		bool operator()(value_type value) {
+			if (!owner.first(value))
+				return true;
+
+			return sink(std::forward<value_type>(value));
+		}
+	};
+
+	ENUMERATOR inner;
+	KEY_SELECTOR key;
+	FlatTable<key_type> seen;
+	holder<value_type> current;
+
+public:
+
+	EnumeratorWithDistinct(ENUMERATOR&& inner, KEY_SELECTOR&& key)
+		: inner(std::move(inner)),
+		  key(std::forward<KEY_SELECTOR>(key)) {
+	}
+
+	EnumeratorWithDistinct(EnumeratorWithDistinct&& other)
+		: inner(std::move(other.inner)),
+		  key(std::forward<KEY_SELECTOR>(other.key)),
+		  seen(std::move(other.seen)),
+		  current(std::move(other.current)) {
+	}
+
+	bool next() {
+		while (inner.next()) {
+			current.set(inner.get());
+			if (first(current.get()))
+				return true;
+		}
+
+		current.clear();
+		return false;
+	}
+
+	value_type get() {
+		return current.get();
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		DistinctSink<SINK> distinct = { *this, sink };
+		return detail::push(inner, distinct);
+	}
+
+	// Any element can be a repeated one
+	SizeHint size_hint() const {
+		return SizeHint(inner.size_hint().size, false);
+	}
+
+	void recycle(PlanScratch& scratch) {
+		scratch.exchange(seen);
+		detail::recycle(inner, scratch);
+	}
+
+private:
+
+	bool first(typename std::remove_reference<value_type>::type& value) {
+		bool inserted;
+		seen.insert(key(value), inserted);
+		return inserted;
+	}
+};
+
+
+// Joins the elements of outer and inner with equal keys. In the first call the side with the smaller size_hint
+// (inner if a size is unknown) is read into a hash table, and the other side is streamed through it, so the
+// results follow the order of the streamed side.
+template <typename OUTER, typename INNER, typename OUTER_KEY, typename INNER_KEY, typename RESULT>
+class EnumeratorWithJoin : no_copy
+{
+public:
+
+	typedef typename OUTER::value_type outer_type;
+	typedef typename INNER::value_type inner_type;
+	typedef typename simple_type<typename result_of<OUTER_KEY(outer_type&)>::type>::type key_type;
+	typedef typename result_of<RESULT(outer_type&, inner_type&)>::type value_type;
+
+private:
+
+	typedef storage<outer_type> outer_storage;
+	typedef storage<inner_type> inner_storage;
+	typedef typename outer_storage::type outer_item;
+	typedef typename inner_storage::type inner_item;
+
+	template <typename T, typename KEY_SELECTOR, typename ITEM>
+	struct BuildSink
+	{
+		KEY_SELECTOR& key;
+		KeyedItems<key_type, ITEM>& table;
+
+		bool operator()(T value) {
+			std::size_t index = table.add_key(key(value));
+			table.add(index, storage<T>::store(std::forward<T>(value)));
+			return true;
+		}
+	};
+
+	template <typename SINK>
+	struct OuterProbeSink
+	{
+		EnumeratorWithJoin& owner;
+		SINK& sink;
+
+		bool operator()(outer_type value) {
+			std::size_t index = owner.inner_table.find(owner.outer_key(value));
+			if (index == owner.inner_table.npos)
+				return true;
+
+			for (inner_item* it = owner.inner_table.begin(index), *end = owner.inner_table.end(index); it != end; ++it) {
+				if (!sink(owner.result(value, inner_storage::load(*it)))) {
+					// Left as next() would leave it, so the following call continues with the next match
+					owner.outer_current.set(std::forward<outer_type>(value));
+					owner.inner_match = it;
+					owner.inner_end = end;
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	template <typename SINK>
+	struct InnerProbeSink
+	{
+		EnumeratorWithJoin& owner;
+		SINK& sink;
+
+		bool operator()(inner_type value) {
+			std::size_t index = owner.outer_table.find(owner.inner_key(value));
+			if (index == owner.outer_table.npos)
+				return true;
+
+			for (outer_item* it = owner.outer_table.begin(index), *end = owner.outer_table.end(index); it != end; ++it) {
+				if (!sink(owner.result(outer_storage::load(*it), value))) {
+					owner.inner_current.set(std::forward<inner_type>(value));
+					owner.outer_match = it;
+					owner.outer_end = end;
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	OUTER outer;
+	INNER inner;
+	OUTER_KEY outer_key;
+	INNER_KEY inner_key;
+	RESULT result;
+	bool built;
+	bool outer_built;
+	KeyedItems<key_type, outer_item> outer_table;
+	KeyedItems<key_type, inner_item> inner_table;
+	// Streamed element and its matches, for next()/get()
+	holder<outer_type> outer_current;
+	holder<inner_type> inner_current;
+	outer_item* outer_match;
+	outer_item* outer_end;
+	inner_item* inner_match;
+	inner_item* inner_end;
+
+public:
+
+	EnumeratorWithJoin(OUTER&& outer, INNER&& inner, OUTER_KEY&& outer_key, INNER_KEY&& inner_key, RESULT&& result)
+		: outer(std::move(outer)),
+		  inner(std::move(inner)),
+		  outer_key(std::forward<OUTER_KEY>(outer_key)),
+		  inner_key(std::forward<INNER_KEY>(inner_key)),
+		  result(std::forward<RESULT>(result)),
+		  built(false),
+		  outer_built(false),
+		  outer_match(nullptr),
+		  outer_end(nullptr),
+		  inner_match(nullptr),
+		  inner_end(nullptr) {
+	}
+
+	// Only moved before the enumeration starts
+	EnumeratorWithJoin(EnumeratorWithJoin&& other)
+		: outer(std::move(other.outer)),
+		  inner(std::move(other.inner)),
+		  outer_key(std::forward<OUTER_KEY>(other.outer_key)),
+		  inner_key(std::forward<INNER_KEY>(other.inner_key)),
+		  result(std::forward<RESULT>(other.result)),
+		  built(false),
+		  outer_built(false),
+		  outer_match(nullptr),
+		  outer_end(nullptr),
+		  inner_match(nullptr),
+		  inner_end(nullptr) {
+	}
+
+	bool next() {
+		build();
+
+		if (outer_built)
+			return next(inner, inner_key, inner_current, outer_table, outer_match, outer_end);
+		else
+			return next(outer, outer_key, outer_current, inner_table, inner_match, inner_end);
+	}
+
+	value_type get() {
+		if (outer_built)
+			return result(outer_storage::load(*outer_match), inner_current.get());
+		else
+			return result(outer_current.get(), inner_storage::load(*inner_match));
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		build();
+
+		// Matches left by next()
+		while (outer_built ? pending(outer_match, outer_end) : pending(inner_match, inner_end)) {
+			next();
+			if (!sink(get()))
+				return false;
+		}
+
+		if (outer_built) {
+			InnerProbeSink<SINK> probe = { *this, sink };
+			return detail::push(inner, probe);
+
+		} else {
+			OuterProbeSink<SINK> probe = { *this, sink };
+			return detail::push(outer, probe);
+		}
+	}
+
+	SizeHint size_hint() const {
+		return SizeHint::unknown();
+	}
+
+	void recycle(PlanScratch& scratch) {
+		scratch.exchange(outer_table);
+		scratch.exchange(inner_table);
+		detail::recycle(outer, scratch);
+		detail::recycle(inner, scratch);
+	}
+
+private:
+
+	void build() {
+		if (built)
+			return;
+		built = true;
+
+		SizeHint outer_hint = outer.size_hint();
+		SizeHint inner_hint = inner.size_hint();
+		outer_built = outer_hint.known() && inner_hint.known() && outer_hint.size < inner_hint.size;
+
+		if (outer_built)
+			build(outer, outer_key, outer_table, outer_hint);
+		else
+			build(inner, inner_key, inner_table, inner_hint);
+	}
+
+	template <typename ENUMERATOR, typename KEY_SELECTOR, typename ITEM>
+	static void build(ENUMERATOR& enumerator, KEY_SELECTOR& key, KeyedItems<key_type, ITEM>& table, SizeHint hint) {
+		if (hint.exact)
+			table.reserve(hint.size);
+
+		BuildSink<typename ENUMERATOR::value_type, KEY_SELECTOR, ITEM> sink = { key, table };
+		detail::push(enumerator, sink);
+		table.finish();
+	}
+
+	template <typename ITEM>
+	static bool pending(ITEM* match, ITEM* end) {
+		return match != end && match + 1 != end;
+	}
+
+	template <typename ENUMERATOR, typename KEY_SELECTOR, typename CURRENT, typename ITEM>
+	static bool next(ENUMERATOR& probe, KEY_SELECTOR& key, CURRENT& current, KeyedItems<key_type, ITEM>& table, ITEM*& match, ITEM*& end) {
+		if (match != end && ++match != end)
+			return true;
+
+		while (probe.next()) {
+			current.set(probe.get());
+
+			std::size_t index = table.find(key(current.get()));
+			if (index != table.npos) {
+				match = table.begin(index);
+				end = table.end(index);
+				return true;
+			}
+		}
+
+		match = end = nullptr;
+		return false;
+	}
+};
+
+
+// Enumerators created by where(), select(), take(), skip() and the casts. A stage of the same kind as the
+// previous one is merged into it, so long chains do not add one enumerator (and one call per element) for each stage.
+template <typename ENUMERATOR, typename PREDICATE>
+struct where_enumerator
+{
+	typedef EnumeratorWithFilter<ENUMERATOR, PREDICATE> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner, PREDICATE&& predicate) {
+		return type(std::move(inner), std::forward<PREDICATE>(predicate));
+	}
+};
+
+template <typename ENUMERATOR, typename FIRST, typename PREDICATE>
+struct where_enumerator<EnumeratorWithFilter<ENUMERATOR, FIRST>, PREDICATE>
+{
+	typedef EnumeratorWithFilter<ENUMERATOR, BothPredicates<FIRST, PREDICATE>> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithFilter<ENUMERATOR, FIRST>&& inner, PREDICATE&& predicate) {
+		return inner.where(std::forward<PREDICATE>(predicate));
+	}
+};
+
+template <typename ENUMERATOR, typename TRANSFORM>
+struct select_enumerator
+{
+	typedef EnumeratorWithTransform<ENUMERATOR, TRANSFORM> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner, TRANSFORM&& transform) {
+		return type(std::move(inner), std::forward<TRANSFORM>(transform));
+	}
+};
+
+template <typename ENUMERATOR, typename FIRST, typename TRANSFORM>
+struct select_enumerator<EnumeratorWithTransform<ENUMERATOR, FIRST>, TRANSFORM>
+{
+	typedef EnumeratorWithTransform<ENUMERATOR, ComposedTransform<FIRST, TRANSFORM>> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithTransform<ENUMERATOR, FIRST>&& inner, TRANSFORM&& transform) {
+		return inner.select(std::forward<TRANSFORM>(transform));
+	}
+};
+
+template <typename ENUMERATOR>
+struct take_enumerator
+{
+	typedef EnumeratorWithTake<ENUMERATOR> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner, std::size_t count) {
+		return type(std::move(inner), count);
+	}
+};
+
+template <typename ENUMERATOR>
+struct take_enumerator<EnumeratorWithTake<ENUMERATOR>>
+{
+	typedef EnumeratorWithTake<ENUMERATOR> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithTake<ENUMERATOR>&& inner, std::size_t count) {
+		return inner.take(count);
+	}
+};
+
+template <typename ENUMERATOR>
+struct skip_enumerator
+{
+	typedef EnumeratorWithSkip<ENUMERATOR> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner, std::size_t count) {
+		return type(std::move(inner), count);
+	}
+};
+
+template <typename ENUMERATOR>
+struct skip_enumerator<EnumeratorWithSkip<ENUMERATOR>>
+{
+	typedef EnumeratorWithSkip<ENUMERATOR> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithSkip<ENUMERATOR>&& inner, std::size_t count) {
+		return inner.skip(count);
+	}
+};
+
+template <typename ENUMERATOR, typename U>
+struct static_cast_enumerator
+{
+	typedef EnumeratorWithStaticCast<ENUMERATOR, U> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner) {
+		return type(std::move(inner));
+	}
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA, typename U>
+struct static_cast_enumerator<EnumeratorWithStaticCast<ENUMERATOR, T, VIA...>, U>
+{
+	typedef EnumeratorWithStaticCast<ENUMERATOR, U, VIA..., T> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithStaticCast<ENUMERATOR, T, VIA...>&& inner) {
+		return inner.template cast_static<U>();
+	}
+};
+
+template <typename ENUMERATOR, typename U>
+struct dynamic_cast_enumerator
+{
+	typedef EnumeratorWithDynamicCast<ENUMERATOR, U> type;
+
+	CLINQ_CONSTEXPR static type create(ENUMERATOR&& inner) {
+		return type(std::move(inner));
+	}
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA, typename U>
+struct dynamic_cast_enumerator<EnumeratorWithDynamicCast<ENUMERATOR, T, VIA...>, U>
+{
+	typedef EnumeratorWithDynamicCast<ENUMERATOR, U, VIA..., T> type;
+
+	CLINQ_CONSTEXPR static type create(EnumeratorWithDynamicCast<ENUMERATOR, T, VIA...>&& inner) {
+		return inner.template cast_dynamic<U>();
+	}
+};
+
+
+template <typename ENUMERATOR, typename TRANSFORM>
+struct is_random_access<EnumeratorWithTransform<ENUMERATOR, TRANSFORM>> : is_random_access<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR>
+struct is_random_access<EnumeratorWithTake<ENUMERATOR>> : is_random_access<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR>
+struct is_random_access<EnumeratorWithSkip<ENUMERATOR>> : is_random_access<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA>
+struct is_random_access<EnumeratorWithStaticCast<ENUMERATOR, T, VIA...>> : is_random_access<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR, typename T, typename... VIA>
+struct is_random_access<EnumeratorWithDynamicCast<ENUMERATOR, T, VIA...>> : is_random_access<ENUMERATOR>
+{
+};
+
+
+// Enumerators that implement next_values(), used to copy the results with the kernels
+template <typename ENUMERATOR>
+struct has_value_kernel : std::false_type
+{
+};
+
+template <typename ENUMERATOR, typename PREDICATE>
+struct has_value_kernel<EnumeratorWithFilter<ENUMERATOR, PREDICATE>> : is_contiguous<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR, typename TRANSFORM>
+struct has_value_kernel<EnumeratorWithTransform<ENUMERATOR, TRANSFORM>>
+	: std::integral_constant<bool, is_contiguous<ENUMERATOR>::value
+	                               && std::is_arithmetic<typename simple_type<typename EnumeratorWithTransform<ENUMERATOR, TRANSFORM>::value_type>::type>::value>
+{
+};
+
+template <typename ENUMERATOR>
+struct has_value_kernel<EnumeratorWithTake<ENUMERATOR>> : has_value_kernel<ENUMERATOR>
+{
+};
+
+template <typename ENUMERATOR>
+struct has_value_kernel<EnumeratorWithSkip<ENUMERATOR>> : has_value_kernel<ENUMERATOR>
+{
+};
+
+
+// Sinks used by the terminal operations
+
+template <typename ACTION>
+struct ActionSink
+{
+	ACTION& action;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		action(std::forward<V>(value));
+		return true;
+	}
+};
+
+template <typename OUTPUT_ITERATOR>
+struct OutputSink
+{
+	OUTPUT_ITERATOR& result;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		*result = std::forward<V>(value);
+		++result;
+		return true;
+	}
+};
+
+template <typename ACC, typename OP>
+struct FoldSink
+{
+	ACC& acc;
+	OP& op;
+	std::size_t count;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		acc = op(acc, value);
+		++count;
+		return true;
+	}
+};
+
+struct CountSink
+{
+	std::size_t count;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&&) {
+		++count;
+		return true;
+	}
+};
+
+template <typename T, std::size_t N>
+struct ArraySink
+{
+	std::array<T, N>& result;
+	std::size_t count;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		result[count++] = std::forward<V>(value);
+		return count < N;
+	}
+};
+
+// Continues while predicate returns VALUE
+template <typename PREDICATE, bool VALUE>
+struct WhileSink
+{
+	PREDICATE& predicate;
+
+	template <typename V>
+	CLINQ_CONSTEXPR bool operator()(V&& value) {
+		return bool(predicate(std::forward<V>(value))) == VALUE;
+	}
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Coroutines
+
+
+#ifdef CLINQ_HAS_COROUTINES
+
+template <typename T, typename ALLOCATOR>
+class GeneratorEnumerator;
+
+// Return type of coroutines that co_yield T elements to a query. Values are yielded as const T&, references
+// (generator<const Node&>) as they are, and nothing is copied until the query reads the element. co_yield of
+// another generator yields all its elements: the nested coroutine is resumed directly, with symmetric transfer,
+// so deep recursion does not use the stack. The coroutine frames are allocated with ALLOCATOR.
+template <typename T, typename ALLOCATOR>
+class Generator : no_copy
+{
+public:
+
+	class promise_type;
+
+private:
+
+	typedef std::coroutine_handle<promise_type> handle_type;
+	typedef typename std::conditional<std::is_reference<T>::value, T, const T&>::type yielded;
+	typedef typename std::remove_reference<yielded>::type* pointer;
+
+	// Resumes the coroutine that yielded the nested generator when it ends
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept {
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(handle_type handle) noexcept {
+			promise_type& promise = handle.promise();
+			if (!promise.parent)
+				return std::noop_coroutine();
+
+			promise.root->leaf = promise.parent;
+			return promise.parent;
+		}
+
+		void await_resume() noexcept {
+		}
+	};
+
+	// Starts a nested generator, whose elements are read by the root before the coroutine continues
+	class NestedAwaiter
+	{
+		Generator nested;
+
+	public:
+
+		explicit NestedAwaiter(Generator&& nested)
+			: nested(std::move(nested)) {
+		}
+
+		bool await_ready() noexcept {
+			return !nested.handle;
+		}
+
+		std::coroutine_handle<> await_suspend(handle_type handle) noexcept {
+			promise_type& promise = nested.handle.promise();
+			promise.root = handle.promise().root;
+			promise.parent = handle;
+			promise.root->leaf = nested.handle;
+			return nested.handle;
+		}
+
+		void await_resume() {
+			if (nested.handle.promise().error)
+				std::rethrow_exception(nested.handle.promise().error);
+		}
+	};
+
+public:
+
+	class promise_type
+	{
+		typedef typename std::allocator_traits<ALLOCATOR>::template rebind_alloc<std::max_align_t> allocator;
+
+		static std::size_t blocks(std::size_t size) {
+			return (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+		}
+
+	public:
+
+		// Only valid in the root: the coroutine to resume for the next element, and the element it yielded
+		handle_type leaf;
+		pointer value;
+
+		promise_type* root;
+		handle_type parent;
+		std::exception_ptr error;
+
+		promise_type()
+			: value(nullptr),
+			  root(this) {
+		}
+
+		static void* operator new(std::size_t size) {
+			allocator alloc;
+			return std::allocator_traits<allocator>::allocate(alloc, blocks(size));
+		}
+
+		static void operator delete(void* frame, std::size_t size) {
+			allocator alloc;
+			std::allocator_traits<allocator>::deallocate(alloc, static_cast<std::max_align_t*>(frame), blocks(size));
+		}
+
+		Generator get_return_object() {
+			leaf = handle_type::from_promise(*this);
+			return Generator(leaf);
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return std::suspend_always();
+		}
+
+		FinalAwaiter final_suspend() noexcept {
+			return FinalAwaiter();
+		}
+
+		std::suspend_always yield_value(yielded element) noexcept {
+			root->value = std::addressof(element);
+			return std::suspend_always();
+		}
+
+		NestedAwaiter yield_value(Generator&& nested) noexcept {
+			return NestedAwaiter(std::move(nested));
+		}
+
+		void return_void() noexcept {
+		}
+
+		void unhandled_exception() {
+			error = std::current_exception();
+		}
+	};
+
+	Generator(Generator&& other)
+		: handle(other.handle) {
+		other.handle = nullptr;
+	}
+
+	~Generator() {
+		if (handle)
+			handle.destroy();
+	}
+
+private:
+
+	handle_type handle;
+
+	explicit Generator(handle_type handle)
+		: handle(handle) {
+	}
+
+	friend class GeneratorEnumerator<T, ALLOCATOR>;
+};
+
+// Elements yielded by a coroutine. next() resumes it until the following co_yield, so a query that stops early
+// (take, first, any) also stops the coroutine.
+template <typename T, typename ALLOCATOR>
+class GeneratorEnumerator : no_copy
+{
+	Generator<T, ALLOCATOR> generator;
+
+public:
+
+	typedef T value_type;
+
+	explicit GeneratorEnumerator(Generator<T, ALLOCATOR>&& generator)
+		: generator(std::move(generator)) {
+	}
+
+	GeneratorEnumerator(GeneratorEnumerator&& other)
+		: generator(std::move(other.generator)) {
+	}
+
+	bool next() {
+		auto root = generator.handle;
+		if (!root || root.done())
+			return false;
+
+		root.promise().leaf.resume();
+		if (!root.done())
+			return true;
+
+		if (root.promise().error)
+			std::rethrow_exception(root.promise().error);
+		return false;
+	}
+
+	value_type get() {
+		return *generator.handle.promise().value;
+	}
+
+	SizeHint size_hint() const {
+		return SizeHint::unknown();
+	}
+};
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Type erasure
+
+
+// Elements read by each virtual call of an AnyEnumerator
+const std::size_t any_batch_size = 256;
+
+// Enumerator behind an AnyEnumerator
+template <typename T>
+class AnySource
+{
+public:
+
+	virtual ~AnySource() {
+	}
+
+	virtual std::size_t next_batch(typename storage<T>::type* out, std::size_t max) = 0;
+
+	virtual SizeHint size_hint() const = 0;
+
+	virtual void limit(std::size_t count) = 0;
+
+	// Moves the enumerator to buffer, returns the new source
+	virtual AnySource* move_to(void* buffer) = 0;
+};
+
+template <typename T, typename ENUMERATOR>
+class AnySourceOf : public AnySource<T>, no_copy
+{
+	typedef storage<T> storage_type;
+	typedef storage<typename ENUMERATOR::value_type> inner_storage_type;
+
+	// Converts the pushed elements into the batch and stops when it is full
+	struct BatchSink
+	{
+		typename storage_type::type* out;
+		std::size_t max;
+		std::size_t count;
+
+		template <typename V>
+		bool operator()(V&& value) {
+			out[count++] = storage_type::store(static_cast<T>(std::forward<V>(value)));
+			return count < max;
+		}
+	};
+
+	ENUMERATOR enumerator;
+
+	// Values are pushed into out, so the fused loop of the erased query runs once for each batch
+	std::size_t batch(typename storage_type::type* out, std::size_t max, std::false_type /* is_reference<T> */) {
+		if (max < 1)
+			return 0;
+
+		BatchSink sink = { out, max, 0 };
+		detail::push(enumerator, sink);
+		return sink.count;
+	}
+
+	// References are read with next_batch(), whose batches do not mix elements that are replaced while the batch
+	// is filled (the sub lists of select_many)
+	std::size_t batch(typename storage_type::type* out, std::size_t max, std::true_type /* is_reference<T> */) {
+		return references(out, max, std::is_same<typename storage_type::type, typename inner_storage_type::type>());
+	}
+
+	// Same stored type: the batch is read directly into out
+	std::size_t references(typename storage_type::type* out, std::size_t max, std::true_type) {
+		return detail::next_batch(enumerator, out, max);
+	}
+
+	std::size_t references(typename storage_type::type* out, std::size_t max, std::false_type) {
+		typename inner_storage_type::type values[any_batch_size];
+		std::size_t count = detail::next_batch(enumerator, values, std::min(max, any_batch_size));
+
+		for (std::size_t i = 0; i < count; i++)
+			out[i] = storage_type::store(static_cast<T>(inner_storage_type::release(values[i])));
+
+		return count;
+	}
+
+public:
+
+	explicit AnySourceOf(ENUMERATOR&& enumerator)
+		: enumerator(std::move(enumerator)) {
+	}
+
+	std::size_t next_batch(typename storage_type::type* out, std::size_t max) {
+		return batch(out, max, std::is_reference<T>());
+	}
+
+	SizeHint size_hint() const {
+		return enumerator.size_hint();
+	}
+
+	void limit(std::size_t count) {
+		detail::limit(enumerator, count);
+	}
+
+	AnySource<T>* move_to(void* buffer) {
+		return new (buffer) AnySourceOf(std::move(enumerator));
+	}
+};
+
+// Enumerator with the type of the erased one, kept inline when it fits in CLINQ_ANY_SIZE bytes. The elements are
+// read in batches, so there is one virtual call for each any_batch_size elements. The batch is allocated by the
+// first next() or push(), next_batch() reads directly into the caller's buffer.
+template <typename T>
+class AnyEnumerator : no_copy
+{
+	typedef storage<T> storage_type;
+
+	typename std::aligned_storage<CLINQ_ANY_SIZE>::type buffer;
+	AnySource<T>* source;
+	std::unique_ptr<typename storage_type::type[]> items;
+	std::size_t current;
+	std::size_t count;
+
+	template <typename ENUMERATOR>
+	AnySource<T>* create(ENUMERATOR&& enumerator, std::true_type) {
+		return new (&buffer) AnySourceOf<T, ENUMERATOR>(std::move(enumerator));
+	}
+
+	template <typename ENUMERATOR>
+	AnySource<T>* create(ENUMERATOR&& enumerator, std::false_type) {
+		return new AnySourceOf<T, ENUMERATOR>(std::move(enumerator));
+	}
+
+	bool is_inline() const {
+		return static_cast<const void*>(source) == static_cast<const void*>(&buffer);
+	}
+
+	std::size_t buffered() const {
+		return current < count ? count - current - 1 : 0;
+	}
+
+	// Reads the following batch into items, current is its first element
+	bool fill() {
+		if (!items)
+			items.reset(new typename storage_type::type[any_batch_size]);
+
+		current = 0;
+		count = source->next_batch(items.get(), any_batch_size);
+		return count > 0;
+	}
+
+public:
+
+	typedef T value_type;
+
+	template <typename ENUMERATOR>
+	explicit AnyEnumerator(ENUMERATOR&& enumerator)
+		: source(create(std::move(enumerator),
+		                std::integral_constant<bool, sizeof(AnySourceOf<T, ENUMERATOR>) <= CLINQ_ANY_SIZE
+		                                             && std::alignment_of<AnySourceOf<T, ENUMERATOR>>::value
+		                                                <= std::alignment_of<decltype(buffer)>::value>())),
+		  current(0),
+		  count(0) {
+		static_assert(!std::is_reference<T>::value || std::is_reference<typename std::decay<ENUMERATOR>::type::value_type>::value,
+		              "any_query of references needs a query of references: the elements it computes are not kept after they are read");
+	}
+
+	// The batch and the position in it move with the enumerator
+	AnyEnumerator(AnyEnumerator&& other)
+		: items(std::move(other.items)),
+		  current(other.current),
+		  count(other.count) {
+		if (other.is_inline()) {
+			source = other.source->move_to(&buffer);
+		} else {
+			source = other.source;
+			other.source = nullptr;
+		}
+
+		other.current = 0;
+		other.count = 0;
+	}
+
+	~AnyEnumerator() {
+		if (is_inline())
+			source->~AnySource();
+		else
+			delete source;
+	}
+
+	bool next() {
+		if (++current < count)
+			return true;
+
+		return fill();
+	}
+
+	value_type get() {
+		return storage_type::load(items[current]);
+	}
+
+	// Hands out the buffered elements first, the following batches are read directly into out
+	std::size_t next_batch(typename storage_type::type* out, std::size_t max) {
+		std::size_t rest = std::min(buffered(), max);
+		if (rest > 0) {
+			std::copy(items.get() + current + 1, items.get() + current + 1 + rest, out);
+			current += rest;
+			return rest;
+		}
+
+		current = count = 0;
+		return source->next_batch(out, max);
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		for (;;) {
+			while (++current < count) {
+				if (!sink(storage_type::release(items[current])))
+					return false;
+			}
+
+			if (!fill())
+				return true;
+
+			if (!sink(storage_type::release(items[0])))
+				return false;
+		}
+	}
+
+	SizeHint size_hint() const {
+		SizeHint hint = source->size_hint();
+		if (!hint.known())
+			return hint;
+
+		return SizeHint(hint.size + buffered(), hint.exact);
+	}
+
+	void limit(std::size_t count) {
+		std::size_t rest = buffered();
+		source->limit(count > rest ? count - rest : 0);
+	}
+};
+
+template <typename ENUMERATOR>
+struct is_any_enumerator : std::false_type
+{
+};
+
+template <typename T>
+struct is_any_enumerator<AnyEnumerator<T>> : std::true_type
+{
+};
+
+
+template <typename ENUMERATOR, typename STAGES>
+class ParallelQuery;
+
+struct IdentityStage;
+
+template <typename ENUMERATOR>
+class Memoized;
+
+template <typename RESULT>
+class PlanOutput;
+
+
+template <typename ENUMERATOR>
+class Query : no_copy
+{
+	template <typename OTHER>
+	friend class Query;
+
+	template <typename RESULT>
+	friend class PlanOutput;
+
+	ENUMERATOR enumerator;
+
+public:
+
+	typedef typename ENUMERATOR::value_type value_type;
+	typedef typename std::remove_cv<typename std::remove_reference<value_type>::type>::type simple_value_type;
+	typedef typename storage<value_type>::type batch_value_type;
+
+	explicit CLINQ_CONSTEXPR Query(ENUMERATOR&& enumerator)
+		: enumerator(std::move(enumerator)) {
+	}
+
+	CLINQ_CONSTEXPR Query(Query&& other)
+		: enumerator(std::move(other.enumerator)) {
+	}
+
+	// Erases the type of other's enumerator, for any_query
+	template <typename OTHER, typename = typename std::enable_if<is_any_enumerator<ENUMERATOR>::value && sizeof(OTHER)>::type>
+	CLINQ_CONSTEXPR Query(Query<OTHER>&& other)
+		: enumerator(std::move(other.enumerator)) {
+	}
+
+	// Single pass iterator: begin() moves to the first element and end() is a sentinel without enumerator
+	class input_iterator
+	{
+		ENUMERATOR* enumerator;
+
+	public:
+
+		typedef std::input_iterator_tag iterator_category;
+		typedef typename ENUMERATOR::value_type reference;
+		typedef typename simple_type<reference>::type value_type;
+		typedef typename std::remove_reference<reference>::type* pointer;
+		typedef std::ptrdiff_t difference_type;
+
+		// Keeps the element for *it++
+		class postfix
+		{
+			typename storage<reference>::type value;
+
+		public:
+
+			explicit postfix(reference value)
+				: value(storage<reference>::store(std::forward<reference>(value))) {
+			}
+
+			reference operator*() {
+				return storage<reference>::load(value);
+			}
+		};
+
+		input_iterator()
+			: enumerator(nullptr) {
+		}
+
+		explicit input_iterator(ENUMERATOR* enumerator)
+			: enumerator(enumerator != nullptr && enumerator->next() ? enumerator : nullptr) {
+		}
+
+		bool operator==(const input_iterator& other) const {
+			return enumerator == other.enumerator;
+		}
+
+		bool operator!=(const input_iterator& other) const {
+			return enumerator != other.enumerator;
+		}
+
+		reference operator*() const {
+			return enumerator->get();
+		}
+
+		input_iterator& operator++() {
+			if (!enumerator->next())
+				enumerator = nullptr;
+			return *this;
+		}
+
+		postfix operator++(int) {
+			postfix result(enumerator->get());
+			++*this;
+			return result;
+		}
+	};
+
+	// Iterator for random access enumerators, reads the elements with at(). Does not consume the query.
+	class random_access_iterator
+	{
+		ENUMERATOR* enumerator;
+		std::ptrdiff_t index;
+
+	public:
+
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef typename ENUMERATOR::value_type reference;
+		typedef typename simple_type<reference>::type value_type;
+		typedef typename std::remove_reference<reference>::type* pointer;
+		typedef std::ptrdiff_t difference_type;
+
+		random_access_iterator()
+			: enumerator(nullptr),
+			  index(0) {
+		}
+
+		random_access_iterator(ENUMERATOR* enumerator, difference_type index)
+			: enumerator(enumerator),
+			  index(index) {
+		}
+
+		reference operator*() const {
+			return enumerator->at(std::size_t(index));
+		}
+
+		reference operator[](difference_type n) const {
+			return enumerator->at(std::size_t(index + n));
+		}
+
+		random_access_iterator& operator++() {
+			++index;
+			return *this;
+		}
+
+		random_access_iterator operator++(int) {
+			random_access_iterator result = *this;
+			++index;
+			return result;
+		}
+
+		random_access_iterator& operator--() {
+			--index;
+			return *this;
+		}
+
+		random_access_iterator operator--(int) {
+			random_access_iterator result = *this;
+			--index;
+			return result;
+		}
+
+		random_access_iterator& operator+=(difference_type n) {
+			index += n;
+			return *this;
+		}
+
+		random_access_iterator& operator-=(difference_type n) {
+			index -= n;
+			return *this;
+		}
+
+		random_access_iterator operator+(difference_type n) const {
+			return random_access_iterator(enumerator, index + n);
+		}
+
+		friend random_access_iterator operator+(difference_type n, const random_access_iterator& it) {
+			return it + n;
+		}
+
+		random_access_iterator operator-(difference_type n) const {
+			return random_access_iterator(enumerator, index - n);
+		}
+
+		difference_type operator-(const random_access_iterator& other) const {
+			return index - other.index;
+		}
+
+		bool operator==(const random_access_iterator& other) const {
+			return index == other.index;
+		}
+
+		bool operator!=(const random_access_iterator& other) const {
+			return index != other.index;
+		}
+
+		bool operator<(const random_access_iterator& other) const {
+			return index < other.index;
+		}
+
+		bool operator>(const random_access_iterator& other) const {
+			return index > other.index;
+		}
+
+		bool operator<=(const random_access_iterator& other) const {
+			return index <= other.index;
+		}
+
+		bool operator>=(const random_access_iterator& other) const {
+			return index >= other.index;
+		}
+	};
+
+	// Random access chains (sources, select, casts, take, skip) can be used with the algorithms that need them
+	typedef typename std::conditional<is_random_access<ENUMERATOR>::value, random_access_iterator, input_iterator>::type iterator;
+
+	CLINQ_CONSTEXPR SizeHint size_hint() const {
+		return enumerator.size_hint();
+	}
+
+	// Block consumption: fills out with up to max elements (references are stored as pointers).
+	// Returns 0 only when there are no more elements.
+	std::size_t next_batch(batch_value_type* out, std::size_t max = batch_size) {
+		return detail::next_batch(enumerator, out, max);
+	}
+
+	iterator begin() {
+		return begin(is_random_access<ENUMERATOR>());
+	}
+
+	iterator end() {
+		return end(is_random_access<ENUMERATOR>());
+	}
+
+	template <typename PREDICATE>
+	CLINQ_CONSTEXPR Query<typename where_enumerator<ENUMERATOR, PREDICATE>::type> where(PREDICATE&& predicate) {
+		static_assert(std::is_same<typename result_of<PREDICATE(value_type)>::type, bool>::value, "PREDICATE must be a function: bool(value_type)");
+
+		return Query<typename where_enumerator<ENUMERATOR, PREDICATE>::type>(
+			where_enumerator<ENUMERATOR, PREDICATE>::create(std::move(enumerator), std::forward<PREDICATE>(predicate))
+		);
+	}
+
+	template <typename TRANSFORM>
+	CLINQ_CONSTEXPR Query<typename select_enumerator<ENUMERATOR, TRANSFORM>::type> select(TRANSFORM&& transform) {
+		return Query<typename select_enumerator<ENUMERATOR, TRANSFORM>::type>(
+			select_enumerator<ENUMERATOR, TRANSFORM>::create(std::move(enumerator), std::forward<TRANSFORM>(transform))
+		);
+	}
+
+	template <typename TRANSFORM>
+	Query<EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>> select_many(TRANSFORM&& transform) {
+		return Query<EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>>(
+			EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>(std::move(enumerator), std::forward<TRANSFORM>(transform))
+		);
+	}
+
+	CLINQ_CONSTEXPR Query<typename take_enumerator<ENUMERATOR>::type> take(std::size_t count) {
+		return Query<typename take_enumerator<ENUMERATOR>::type>(
+			take_enumerator<ENUMERATOR>::create(std::move(enumerator), count)
+		);
+	}
+
+	CLINQ_CONSTEXPR Query<typename skip_enumerator<ENUMERATOR>::type> skip(std::size_t count) {
+		return Query<typename skip_enumerator<ENUMERATOR>::type>(
+			skip_enumerator<ENUMERATOR>::create(std::move(enumerator), count)
+		);
+	}
+
+	template <typename T>
+	CLINQ_CONSTEXPR Query<typename static_cast_enumerator<ENUMERATOR, T>::type> cast_static() {
+		return Query<typename static_cast_enumerator<ENUMERATOR, T>::type>(
+			static_cast_enumerator<ENUMERATOR, T>::create(std::move(enumerator))
+		);
+	}
+
+	template <typename T>
+	CLINQ_CONSTEXPR Query<typename dynamic_cast_enumerator<ENUMERATOR, T>::type> cast_dynamic() {
+		return Query<typename dynamic_cast_enumerator<ENUMERATOR, T>::type>(
+			dynamic_cast_enumerator<ENUMERATOR, T>::create(std::move(enumerator))
+		);
+	}
+
+	template <typename KEY>
+	Query<EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, false>>> order_by(KEY&& key) {
+		return Query<EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, false>>>(
+			EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, false>>(std::move(enumerator), KeyComparer<KEY, false>(std::forward<KEY>(key)))
+		);
+	}
+
+	template <typename KEY>
+	Query<EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, true>>> order_by_descending(KEY&& key) {
+		return Query<EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, true>>>(
+			EnumeratorWithOrder<ENUMERATOR, KeyComparer<KEY, true>>(std::move(enumerator), KeyComparer<KEY, true>(std::forward<KEY>(key)))
+		);
+	}
+
+	template <typename KEY>
+	Query<typename then_by_enumerator<ENUMERATOR, KeyComparer<KEY, false>>::type> then_by(KEY&& key) {
+		return Query<typename then_by_enumerator<ENUMERATOR, KeyComparer<KEY, false>>::type>(
+			enumerator.then(KeyComparer<KEY, false>(std::forward<KEY>(key)))
+		);
+	}
+
+	template <typename KEY>
+	Query<typename then_by_enumerator<ENUMERATOR, KeyComparer<KEY, true>>::type> then_by_descending(KEY&& key) {
+		return Query<typename then_by_enumerator<ENUMERATOR, KeyComparer<KEY, true>>::type>(
+			enumerator.then(KeyComparer<KEY, true>(std::forward<KEY>(key)))
+		);
+	}
+
+	template <typename KEY_SELECTOR>
+	Query<EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, SameElement>> group_by(KEY_SELECTOR&& key) {
+		return Query<EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, SameElement>>(
+			EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, SameElement>(std::move(enumerator), std::forward<KEY_SELECTOR>(key), SameElement())
+		);
+	}
+
+	template <typename KEY_SELECTOR, typename ELEMENT_SELECTOR>
+	Query<EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, ELEMENT_SELECTOR>> group_by(KEY_SELECTOR&& key, ELEMENT_SELECTOR&& element) {
+		return Query<EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, ELEMENT_SELECTOR>>(
+			EnumeratorWithGroup<ENUMERATOR, KEY_SELECTOR, ELEMENT_SELECTOR>(std::move(enumerator), std::forward<KEY_SELECTOR>(key), std::forward<ELEMENT_SELECTOR>(element))
+		);
+	}
+
+	Query<EnumeratorWithDistinct<ENUMERATOR, SameElement>> distinct() {
+		return Query<EnumeratorWithDistinct<ENUMERATOR, SameElement>>(
+			EnumeratorWithDistinct<ENUMERATOR, SameElement>(std::move(enumerator), SameElement())
+		);
+	}
+
+	template <typename KEY_SELECTOR>
+	Query<EnumeratorWithDistinct<ENUMERATOR, KEY_SELECTOR>> distinct_by(KEY_SELECTOR&& key) {
+		return Query<EnumeratorWithDistinct<ENUMERATOR, KEY_SELECTOR>>(
+			EnumeratorWithDistinct<ENUMERATOR, KEY_SELECTOR>(std::move(enumerator), std::forward<KEY_SELECTOR>(key))
+		);
+	}
+
+	template <typename INNER, typename OUTER_KEY, typename INNER_KEY, typename RESULT>
+	Query<EnumeratorWithJoin<ENUMERATOR, INNER, OUTER_KEY, INNER_KEY, RESULT>> join(Query<INNER>&& inner, OUTER_KEY&& outer_key, INNER_KEY&& inner_key, RESULT&& result) {
+		return Query<EnumeratorWithJoin<ENUMERATOR, INNER, OUTER_KEY, INNER_KEY, RESULT>>(
+			EnumeratorWithJoin<ENUMERATOR, INNER, OUTER_KEY, INNER_KEY, RESULT>(
+				std::move(enumerator), std::move(inner.enumerator), std::forward<OUTER_KEY>(outer_key), std::forward<INNER_KEY>(inner_key), std::forward<RESULT>(result)
+			)
+		);
+	}
+
+	// Re-enumerable query, that computes each element once
+	Memoized<ENUMERATOR> memoize() {
+		return Memoized<ENUMERATOR>(std::move(enumerator));
+	}
+
+	ParallelQuery<ENUMERATOR, IdentityStage> parallel(std::size_t threads = 0) {
+		static_assert(is_splittable<ENUMERATOR>::value, "parallel() needs a query created by from() over random access iterators");
 
-	Enumerator(const Enumerator& other);
-	Enumerator& operator=(const Enumerator& other);
+		return ParallelQuery<ENUMERATOR, IdentityStage>(std::move(enumerator), IdentityStage(), threads);
+	}
 
-public:
+	std::vector<simple_value_type> to_vector() {
+		std::vector<simple_value_type> result;
+		to_vector(result, std::integral_constant<bool, has_value_kernel<ENUMERATOR>::value>());
+		return result;
+	}
 
-	typedef typename iterator_traits<ITERATOR>::value_type value_type;
+	// Replaces the elements of result, keeping its capacity
+	void to_vector(std::vector<simple_value_type>& result) {
+		result.clear();
+		to_vector(result, std::integral_constant<bool, has_value_kernel<ENUMERATOR>::value>());
+	}
 
-	Enumerator(ITERATOR&& current, ITERATOR&& end)
-		: current(std::move(current)),
-		  end(std::move(end)) {
-		first = true;
+	// The first N elements. When there are less the rest of the array is value initialized.
+	template <std::size_t N>
+	CLINQ_CONSTEXPR std::array<simple_value_type, N> to_array() {
+		std::array<simple_value_type, N> result = {};
+		ArraySink<simple_value_type, N> sink = { result, 0 };
+		if (N > 0)
+			push(enumerator, sink);
+		return result;
 	}
 
-	Enumerator(Enumerator&& other)
-		: first(other.first),
-		  current(std::move(other.current)),
-		  end(std::move(other.end)) {
+	std::list<simple_value_type> to_list() {
+		std::list<simple_value_type> result;
+		to(result);
+		return result;
 	}
 
-	bool next() {
-		if (first)
-			first = false;
-		else
-			++current;
+	std::set<simple_value_type> to_set() {
+		std::set<simple_value_type> result;
+		to(result);
+		return result;
+	}
 
-		return current != end;
+	// Reserves room in l when the number of elements is known exactly
+	template <typename LIST>
+	void to(LIST& l) {
+		SizeHint hint = enumerator.size_hint();
+		if (hint.exact)
+			reserve(l, hint.size, 0);
+
+		to(std::inserter(l, l.end()));
 	}
 
-	value_type get() {
-		return *current;
+	template <typename OUTPUT_ITERATOR, typename OUTPUT_VALUE_TYPE = decltype(*std::declval<OUTPUT_ITERATOR>())>
+	CLINQ_CONSTEXPR void to(OUTPUT_ITERATOR result) {
+		OutputSink<OUTPUT_ITERATOR> sink = { result };
+		push(enumerator, sink);
 	}
-};
 
+	template <typename ACTION>
+	CLINQ_CONSTEXPR void foreach(ACTION action) {
+		ActionSink<ACTION> sink = { action };
+		push(enumerator, sink);
+	}
 
-class no_copy
-{
-	no_copy(const no_copy& other);
-	no_copy& operator=(const no_copy& other);
+	template <typename PREDICATE>
+	CLINQ_CONSTEXPR bool any(PREDICATE&& predicate) {
+		WhileSink<typename std::remove_reference<PREDICATE>::type, false> sink = { predicate };
+		return !push(enumerator, sink);
+	}
 
-public:
-	no_copy() {
+	CLINQ_CONSTEXPR bool any() {
+		return enumerator.next();
 	}
-};
 
+	template <typename PREDICATE>
+	CLINQ_CONSTEXPR bool all(PREDICATE&& predicate) {
+		WhileSink<typename std::remove_reference<PREDICATE>::type, true> sink = { predicate };
+		return push(enumerator, sink);
+	}
 
-template <typename ENUMERATOR, typename PREDICATE>
-class EnumeratorWithFilter : no_copy
-{
-	ENUMERATOR inner;
-	PREDICATE predicate;
+	// Folds the elements in seed with seed = accumulate(seed, element)
+	template <typename T, typename ACCUMULATE>
+	CLINQ_CONSTEXPR T aggregate(T seed, ACCUMULATE accumulate) {
+		FoldSink<T, ACCUMULATE> sink = { seed, accumulate, 0 };
+		push(enumerator, sink);
+		return seed;
+	}
 
-public:
+	// combine(a, b) merges partial results, it is only used by parallel queries
+	template <typename T, typename ACCUMULATE, typename COMBINE>
+	CLINQ_CONSTEXPR T aggregate(T seed, ACCUMULATE accumulate, COMBINE) {
+		return aggregate(std::move(seed), std::move(accumulate));
+	}
 
-	typedef typename ENUMERATOR::value_type value_type;
+	// Number of elements. Does not read them when the source size is known.
+	CLINQ_CONSTEXPR std::size_t count() {
+		SizeHint hint = enumerator.size_hint();
+		if (hint.exact)
+			return hint.size;
 
-	EnumeratorWithFilter(ENUMERATOR&& inner, PREDICATE&& predicate)
-		: inner(std::move(inner)),
-		  predicate(std::move(predicate)) {
+		CountSink sink = { 0 };
+		push(enumerator, sink);
+		return sink.count;
 	}
 
-	EnumeratorWithFilter(EnumeratorWithFilter&& other)
-		: inner(std::move(other.inner)),
-		  predicate(std::move(other.predicate)) {
+	template <typename PREDICATE>
+	CLINQ_CONSTEXPR std::size_t count(PREDICATE&& predicate) {
+		return where(std::forward<PREDICATE>(predicate)).count();
 	}
 
-	bool next() {
-		while (inner.next()) {
-			if (predicate(inner.get()))
-				return true;
+	// 0 for empty results
+	CLINQ_CONSTEXPR simple_value_type sum() {
+		simple_value_type result = simple_value_type();
+		fold(result, SumOp());
+		return result;
+	}
+
+	template <typename SELECTOR>
+	CLINQ_CONSTEXPR typename Query<EnumeratorWithTransform<ENUMERATOR, SELECTOR>>::simple_value_type sum(SELECTOR&& selector) {
+		return select(std::forward<SELECTOR>(selector)).sum();
+	}
+
+	CLINQ_CONSTEXPR simple_value_type min() {
+		if (!enumerator.next())
+			throw std::runtime_error("no item in result");
+
+		simple_value_type result = enumerator.get();
+		fold(result, MinOp());
+		return result;
+	}
+
+	template <typename SELECTOR>
+	CLINQ_CONSTEXPR typename Query<EnumeratorWithTransform<ENUMERATOR, SELECTOR>>::simple_value_type min(SELECTOR&& selector) {
+		return select(std::forward<SELECTOR>(selector)).min();
+	}
+
+	CLINQ_CONSTEXPR simple_value_type max() {
+		if (!enumerator.next())
+			throw std::runtime_error("no item in result");
+
+		simple_value_type result = enumerator.get();
+		fold(result, MaxOp());
+		return result;
+	}
+
+	template <typename SELECTOR>
+	CLINQ_CONSTEXPR typename Query<EnumeratorWithTransform<ENUMERATOR, SELECTOR>>::simple_value_type max(SELECTOR&& selector) {
+		return select(std::forward<SELECTOR>(selector)).max();
+	}
+
+	// Integers are added as long long
+	CLINQ_CONSTEXPR double average() {
+		static_assert(std::is_arithmetic<simple_value_type>::value, "average() needs a query of numbers");
+
+		typename std::conditional<std::is_integral<simple_value_type>::value, long long, double>::type total = 0;
+		std::size_t count = fold(total, SumOp());
+		if (count < 1)
+			throw std::runtime_error("no item in result");
+
+		return double(total) / double(count);
+	}
+
+	template <typename SELECTOR>
+	CLINQ_CONSTEXPR double average(SELECTOR&& selector) {
+		return select(std::forward<SELECTOR>(selector)).average();
+	}
+
+	CLINQ_CONSTEXPR value_type first() {
+		if (!enumerator.next())
+			throw std::runtime_error("no item in result");
+
+		return enumerator.get();
+	}
+
+	CLINQ_CONSTEXPR simple_value_type first_or_default(const simple_value_type& defaultValue) {
+		if (!enumerator.next())
+			return defaultValue;
+
+		return enumerator.get();
+	}
+
+	CLINQ_CONSTEXPR simple_value_type first_or_default(simple_value_type&& defaultValue) {
+		if (!enumerator.next())
+			return std::move(defaultValue);
+
+		return enumerator.get();
+	}
+
+	// Only for references: V delays the check to the call, so queries of values can still be instantiated
+	template <typename V = value_type, class = typename std::enable_if<std::is_reference<V>::value>::type>
+	CLINQ_CONSTEXPR value_type first_or_default(value_type defaultValue) {
+		if (!enumerator.next())
+			return defaultValue;
+
+		return enumerator.get();
+	}
+
+	CLINQ_CONSTEXPR value_type first_or_default() {
+		if (!enumerator.next())
+			return value_type();
+
+		return enumerator.get();
+	}
+
+private:
+
+	void to_vector(std::vector<simple_value_type>& result, std::false_type) {
+		to(result);
+	}
+
+	// Writes the blocks directly in the result
+	void to_vector(std::vector<simple_value_type>& result, std::true_type) {
+		SizeHint hint = enumerator.size_hint();
+		if (hint.exact)
+			result.reserve(hint.size + batch_size);
+
+		std::size_t size = 0;
+		for (;;) {
+			result.resize(size + batch_size);
+
+			std::size_t count = enumerator.next_values(&result[size], batch_size);
+			if (count < 1)
+				break;
+
+			size += count;
 		}
+		result.resize(size);
+	}
 
-		return false;
+	// Folds the remaining elements in acc with op, returns how many were read. Arrays of numbers, also behind
+	// select, take and skip, are reduced directly by the vector kernels. Filtered values are folded one by one:
+	// compacting them first measured slower than the inlined loop.
+	template <typename ACC, typename OP>
+	CLINQ_CONSTEXPR std::size_t fold(ACC& acc, OP op) {
+#ifdef CLINQ_HAS_CONSTEXPR
+		// The kernels can not run in constant expressions
+		if (std::is_constant_evaluated())
+			return fold(acc, op, std::integral_constant<int, 0>());
+#endif
+		return fold(acc, op, std::integral_constant<int, is_contiguous<ENUMERATOR>::value ? 2
+		                                                 : has_value_kernel<ENUMERATOR>::value && is_random_access<ENUMERATOR>::value ? 1
+		                                                 : 0>());
 	}
 
-	value_type get() {
-		return inner.get();
+	template <typename ACC, typename OP>
+	std::size_t fold(ACC& acc, OP op, std::integral_constant<int, 2>) {
+		std::size_t count = enumerator.remaining();
+		acc = reduce(enumerator.position(), count, acc, op);
+		enumerator.advance(count);
+		return count;
+	}
+
+	template <typename ACC, typename OP>
+	std::size_t fold(ACC& acc, OP op, std::integral_constant<int, 1>) {
+		return enumerator.reduce_values(acc, op, std::numeric_limits<std::size_t>::max());
+	}
+
+	template <typename ACC, typename OP>
+	CLINQ_CONSTEXPR std::size_t fold(ACC& acc, OP op, std::integral_constant<int, 0>) {
+		FoldSink<ACC, OP> sink = { acc, op, 0 };
+		push(enumerator, sink);
+		return sink.count;
+	}
+
+	// advance(0) applies the pending skips, so at() does not change the enumerator while iterating
+	iterator begin(std::true_type) {
+		enumerator.advance(0);
+		return iterator(&enumerator, 0);
+	}
+
+	iterator end(std::true_type) {
+		return iterator(&enumerator, std::ptrdiff_t(enumerator.size_hint().size));
+	}
+
+	iterator begin(std::false_type) {
+		return iterator(&enumerator);
+	}
+
+	iterator end(std::false_type) {
+		return iterator();
 	}
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Memoization
 
-template <typename ENUMERATOR, typename TRANSFORM>
-class EnumeratorWithTransform : no_copy
+
+// Elements already read from source, shared by a Memoized and its readers
+template <typename ENUMERATOR>
+struct MemoState : no_copy
 {
-	ENUMERATOR inner;
-	TRANSFORM transform;
+	ENUMERATOR source;
+	std::vector<typename storage<typename ENUMERATOR::value_type>::type> items;
+	std::mutex mutex;
+	// Set when source ends. After that items does not change and is read without the mutex.
+	std::atomic<bool> complete;
+
+	explicit MemoState(ENUMERATOR&& source)
+		: source(std::move(source)),
+		  complete(false) {
+	}
+};
+
+// Reads the elements of a MemoState, reading one more from source when it gets past the last one
+template <typename ENUMERATOR>
+class EnumeratorWithMemo
+{
+	typedef storage<typename ENUMERATOR::value_type> storage_type;
+
+	std::shared_ptr<MemoState<ENUMERATOR>> state;
+	std::size_t current;
+	std::size_t following;
 
 public:
 
-	typedef typename std::result_of<TRANSFORM(typename ENUMERATOR::value_type)>::type value_type;
+	typedef typename ENUMERATOR::value_type value_type;
 
-	EnumeratorWithTransform(ENUMERATOR&& inner, TRANSFORM&& transform)
-		: inner(std::move(inner)),
-		  transform(std::move(transform)) {
+	explicit EnumeratorWithMemo(const std::shared_ptr<MemoState<ENUMERATOR>>& state)
+		: state(state),
+		  current(0),
+		  following(0) {
 	}
 
-	EnumeratorWithTransform(EnumeratorWithTransform&& other)
-		: inner(std::move(other.inner)),
-		  transform(std::move(other.transform)) {
-	}
+	bool next() {
+		if (state->complete.load(std::memory_order_acquire)) {
+			if (following >= state->items.size())
+				return false;
 
+			current = following++;
+			return true;
+		}
 
-	bool next() {
-		return inner.next();
+		std::lock_guard<std::mutex> lock(state->mutex);
+
+		if (following >= state->items.size()) {
+			if (state->complete.load(std::memory_order_relaxed) || !state->source.next()) {
+				state->complete.store(true, std::memory_order_release);
+				return false;
+			}
+
+			state->items.push_back(storage_type::store(state->source.get()));
+		}
+
+		current = following++;
+		return true;
 	}
 
 	value_type get() {
-		return transform(inner.get());
+		if (state->complete.load(std::memory_order_acquire))
+			return storage_type::load(state->items[current]);
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return storage_type::load(state->items[current]);
 	}
-};
 
+	// Once the buffer is complete it is read without locking
+	template <typename SINK>
+	bool push(SINK& sink) {
+		if (state->complete.load(std::memory_order_acquire)) {
+			while (following < state->items.size()) {
+				current = following++;
+				if (!sink(static_cast<value_type>(storage_type::load(state->items[current]))))
+					return false;
+			}
+			return true;
+		}
 
-template <typename ENUMERATOR, typename TRANSFORM>
-class EnumeratorWithSelectMany : no_copy
+		while (next()) {
+			if (!sink(get()))
+				return false;
+		}
+		return true;
+	}
+
+	SizeHint size_hint() const {
+		if (state->complete.load(std::memory_order_acquire))
+			return SizeHint(state->items.size() - following, true);
+
+		return SizeHint::unknown();
+	}
+};
+
+// Query returned by memoize(), that can be enumerated many times, also from different threads. Each element is
+// computed when a reader first gets to it and is kept in a buffer shared by all the readers.
+template <typename ENUMERATOR>
+class Memoized
 {
-	ENUMERATOR inner;
-	TRANSFORM transform;
+	std::shared_ptr<MemoState<ENUMERATOR>> state;
 
 public:
 
-	typedef typename std::result_of<TRANSFORM(typename ENUMERATOR::value_type)>::type list_type;
-	typedef decltype(std::declval<list_type>().begin()) list_iterator_type;
-	typedef typename iterator_traits<list_iterator_type>::value_type value_type;
-
-private:
+	typedef typename ENUMERATOR::value_type value_type;
 
-	struct SubList
+	class iterator
 	{
-		list_type list;
-		Enumerator<list_iterator_type> enumerator;
+		EnumeratorWithMemo<ENUMERATOR> reader;
+		bool valid;
+
+	public:
+
+		typedef std::input_iterator_tag iterator_category;
+		typedef typename ENUMERATOR::value_type reference;
+		typedef typename simple_type<reference>::type value_type;
+		typedef typename std::remove_reference<reference>::type* pointer;
+		typedef std::ptrdiff_t difference_type;
+
+		iterator(const std::shared_ptr<MemoState<ENUMERATOR>>& state, bool begin)
+			: reader(state),
+			  valid(begin && reader.next()) {
+		}
+
+		bool operator==(const iterator& other) const {
+			return valid == other.valid;
+		}
 
-		SubList(list_type&& list)
-			: list(std::move(list)),
-			  enumerator(this->list.begin(), this->list.end()) {
+		bool operator!=(const iterator& other) const {
+			return valid != other.valid;
+		}
+
+		reference operator*() {
+			return reader.get();
 		}
 
-		SubList() {
+		iterator& operator++() {
+			valid = reader.next();
+			return *this;
 		}
 	};
 
-	std::unique_ptr<SubList> sub;
+	explicit Memoized(ENUMERATOR&& source)
+		: state(std::make_shared<MemoState<ENUMERATOR>>(std::move(source))) {
+	}
+
+	// New query over the elements, from the first one
+	Query<EnumeratorWithMemo<ENUMERATOR>> query() const {
+		return Query<EnumeratorWithMemo<ENUMERATOR>>(EnumeratorWithMemo<ENUMERATOR>(state));
+	}
+
+	iterator begin() const {
+		return iterator(state, true);
+	}
+
+	iterator end() const {
+		return iterator(state, false);
+	}
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parallel execution
+
+
+// Minimum number of elements handled by a thread
+const std::size_t parallel_min_chunk = 4096;
+
+// Indices [0, count) of a parallel call. They are claimed in order by the calling thread and by the pool workers
+// that pick the task, so the call completes even when all the workers are busy.
+class ParallelTask : no_copy
+{
+	std::atomic<std::size_t> following;
+	std::size_t count;
+	std::vector<std::exception_ptr> errors;
+	std::vector<char> done;
+	std::mutex mutex;
+	std::condition_variable finished;
+
+protected:
+
+	virtual void run(std::size_t i) = 0;
 
 public:
 
-	EnumeratorWithSelectMany(ENUMERATOR&& inner, TRANSFORM&& transform)
-		: inner(std::move(inner)),
-		  transform(std::move(transform)) {
+	// Workers running the task, guarded by the mutex of the pool
+	std::size_t active;
+
+	explicit ParallelTask(std::size_t count)
+		: following(0),
+		  count(count),
+		  errors(count),
+		  done(count, 0),
+		  active(0) {
 	}
 
-	EnumeratorWithSelectMany(EnumeratorWithSelectMany&& other)
-		: inner(std::move(other.inner)),
-		  transform(std::move(other.transform)) {
-		std::swap(sub, other.sub);
+	virtual ~ParallelTask() {
 	}
 
-	bool next() {
-		if (sub != nullptr && sub->enumerator.next())
-			return true;
+	// Runs the indices that are left
+	void work() {
+		for (;;) {
+			std::size_t i = following.fetch_add(1);
+			if (i >= count)
+				return;
 
-		while (inner.next()) {
-			sub = std::unique_ptr<SubList>(new SubList(transform(inner.get())));
-			if (sub->enumerator.next())
-				return true;
+			execute(i);
 		}
+	}
+
+	// Claims index i if it is the next one
+	bool claim(std::size_t i) {
+		std::size_t expected = i;
+		return following.compare_exchange_strong(expected, i + 1);
+	}
+
+	// Claims all the indices that were not started
+	void cancel() {
+		following.store(count);
+	}
+
+	void execute(std::size_t i) {
+		try {
+			run(i);
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		done[i] = 1;
+		finished.notify_all();
+	}
+
+	// Waits until index i was run, and throws its error
+	void wait(std::size_t i) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!done[i])
+			finished.wait(lock);
+
+		if (errors[i] != nullptr)
+			std::rethrow_exception(errors[i]);
+	}
+};
+
+template <typename FUNC>
+class ParallelCall : public ParallelTask
+{
+	FUNC& func;
+
+protected:
 
-		return false;
+	void run(std::size_t i) {
+		func(i);
 	}
 
-	value_type get() {
-		return sub->enumerator.get();
+public:
+
+	ParallelCall(std::size_t count, FUNC& func)
+		: ParallelTask(count),
+		  func(func) {
 	}
 };
 
-
-template <typename ENUMERATOR>
-class EnumeratorWithTake : no_copy
+// Threads shared by all the parallel queries. They are started by the first call that needs them and wait for
+// the following calls, so a query does not pay for creating threads.
+class ThreadPool : no_copy
 {
-	ENUMERATOR inner;
-	std::size_t count;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<ParallelTask*> tasks;
+	std::vector<std::thread> workers;
+	bool stopping;
+
+	void loop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			while (!stopping && tasks.empty())
+				wake.wait(lock);
+
+			if (tasks.empty())
+				return;
+
+			ParallelTask* task = tasks.front();
+			tasks.pop_front();
+			++task->active;
+
+			lock.unlock();
+			task->work();
+			lock.lock();
+
+			if (--task->active == 0)
+				idle.notify_all();
+		}
+	}
 
 public:
 
-	typedef typename ENUMERATOR::value_type value_type;
-
-	EnumeratorWithTake(ENUMERATOR&& inner, std::size_t count)
-		: inner(std::move(inner)),
-		  count(count) {
+	ThreadPool()
+		: stopping(false) {
 	}
 
-	EnumeratorWithTake(EnumeratorWithTake&& other)
-		: inner(std::move(other.inner)),
-		  count(other.count) {
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+
+		for (std::size_t i = 0; i < workers.size(); ++i)
+			workers[i].join();
 	}
 
-	bool next() {
-		if (count < 1)
-			return false;
+	// Asks helpers workers to run task, starting the ones that are missing
+	void start(ParallelTask& task, std::size_t helpers) {
+		if (helpers < 1)
+			return;
 
-		--count;
-		return inner.next();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			while (workers.size() < helpers)
+				workers.push_back(std::thread(&ThreadPool::loop, this));
+
+			for (std::size_t i = 0; i < helpers; ++i)
+				tasks.push_back(&task);
+		}
+		wake.notify_all();
 	}
 
-	value_type get() {
-		return inner.get();
+	// Withdraws the requests for task that were not picked and waits for the workers running it
+	void finish(ParallelTask& task) {
+		std::unique_lock<std::mutex> lock(mutex);
+		tasks.erase(std::remove(tasks.begin(), tasks.end(), &task), tasks.end());
+
+		while (task.active > 0)
+			idle.wait(lock);
 	}
 };
 
+inline ThreadPool& thread_pool() {
+	static ThreadPool pool;
+	return pool;
+}
 
-template <typename ENUMERATOR>
-class EnumeratorWithSkip : no_copy
+// Shares a task with the pool while it is in scope. When it ends the indices that were not started are dropped and
+// the workers still running the task are waited for, so the task can be destroyed even after an exception.
+class ParallelScope : no_copy
 {
-	ENUMERATOR inner;
-	std::size_t count;
+	ParallelTask& task;
 
 public:
 
-	typedef typename ENUMERATOR::value_type value_type;
+	ParallelScope(ParallelTask& task, std::size_t helpers)
+		: task(task) {
+		thread_pool().start(task, helpers);
+	}
 
-	EnumeratorWithSkip(ENUMERATOR&& inner, std::size_t count)
-		: inner(std::move(inner)),
-		  count(count) {
+	~ParallelScope() {
+		task.cancel();
+		thread_pool().finish(task);
 	}
+};
 
-	EnumeratorWithSkip(EnumeratorWithSkip&& other)
-		: inner(std::move(other.inner)),
-		  count(other.count) {
+// Calls func(i) for i in [0, count) in the threads of the pool. The calling thread runs indices too.
+template <typename FUNC>
+void run_parallel(std::size_t count, FUNC& func) {
+	ParallelCall<FUNC> call(count, func);
+	{
+		ParallelScope scope(call, count - 1);
+		call.work();
 	}
 
-	bool next() {
-		while (count > 0) {
-			if (!inner.next())
-				return false;
+	for (std::size_t i = 0; i < count; ++i)
+		call.wait(i);
+}
 
-			--count;
-		}
 
-		return inner.next();
-	}
+// Stages record the operations applied to a ParallelQuery, so they can be replayed over each chunk
 
-	value_type get() {
-		return inner.get();
+struct IdentityStage
+{
+	template <typename QUERY>
+	QUERY operator()(QUERY&& query) const {
+		return std::move(query);
 	}
 };
 
 
-template <typename ENUMERATOR, typename T>
-class EnumeratorWithStaticCast : no_copy
+template <typename PREVIOUS, typename PREDICATE>
+struct WhereStage
 {
-	ENUMERATOR inner;
-
-public:
-
-	typedef T value_type;
+	PREVIOUS previous;
+	PREDICATE predicate;
 
-	EnumeratorWithStaticCast(ENUMERATOR&& inner)
-		: inner(std::move(inner)) {
+	WhereStage(PREVIOUS&& previous, PREDICATE&& predicate)
+		: previous(std::move(previous)),
+		  predicate(std::move(predicate)) {
 	}
 
-	EnumeratorWithStaticCast(EnumeratorWithStaticCast&& other)
-		: inner(std::move(other.inner)) {
+	template <typename QUERY>
+	auto operator()(QUERY&& query) const
+	-> decltype(std::declval<const PREVIOUS&>()(std::move(query)).where(std::declval<PREDICATE>())) {
+		return previous(std::move(query)).where(PREDICATE(predicate));
 	}
+};
 
 
-	bool next() {
-		return inner.next();
+template <typename PREVIOUS, typename TRANSFORM>
+struct SelectStage
+{
+	PREVIOUS previous;
+	TRANSFORM transform;
+
+	SelectStage(PREVIOUS&& previous, TRANSFORM&& transform)
+		: previous(std::move(previous)),
+		  transform(std::move(transform)) {
 	}
 
-	value_type get() {
-		return static_cast<T>(inner.get());
+	template <typename QUERY>
+	auto operator()(QUERY&& query) const
+	-> decltype(std::declval<const PREVIOUS&>()(std::move(query)).select(std::declval<TRANSFORM>())) {
+		return previous(std::move(query)).select(TRANSFORM(transform));
 	}
 };
 
 
-template <typename ENUMERATOR, typename T>
-class EnumeratorWithDynamicCast : no_copy
+template <typename PREVIOUS, typename TRANSFORM>
+struct SelectManyStage
 {
-	ENUMERATOR inner;
-
-public:
-
-	typedef T value_type;
+	PREVIOUS previous;
+	TRANSFORM transform;
 
-	EnumeratorWithDynamicCast(ENUMERATOR&& inner)
-		: inner(std::move(inner)) {
+	SelectManyStage(PREVIOUS&& previous, TRANSFORM&& transform)
+		: previous(std::move(previous)),
+		  transform(std::move(transform)) {
 	}
 
-	EnumeratorWithDynamicCast(EnumeratorWithDynamicCast&& other)
-		: inner(std::move(other.inner)) {
+	template <typename QUERY>
+	auto operator()(QUERY&& query) const
+	-> decltype(std::declval<const PREVIOUS&>()(std::move(query)).select_many(std::declval<TRANSFORM>())) {
+		return previous(std::move(query)).select_many(TRANSFORM(transform));
 	}
+};
 
 
-	bool next() {
-		return inner.next();
+template <typename PREVIOUS, typename T>
+struct StaticCastStage
+{
+	PREVIOUS previous;
+
+	StaticCastStage(PREVIOUS&& previous)
+		: previous(std::move(previous)) {
 	}
 
-	value_type get() {
-		return dynamic_cast<T>(inner.get());
+	template <typename QUERY>
+	auto operator()(QUERY&& query) const
+	-> decltype(std::declval<const PREVIOUS&>()(std::move(query)).template cast_static<T>()) {
+		return previous(std::move(query)).template cast_static<T>();
 	}
 };
 
 
-template <typename ENUMERATOR>
-class Query : no_copy
+template <typename PREVIOUS, typename T>
+struct DynamicCastStage
 {
-	ENUMERATOR enumerator;
-
-public:
-
-	typedef typename ENUMERATOR::value_type value_type;
-	typedef typename std::remove_cv<typename std::remove_reference<value_type>::type>::type simple_value_type;
+	PREVIOUS previous;
 
-	explicit Query(ENUMERATOR&& enumerator)
-		: enumerator(std::move(enumerator)) {
+	DynamicCastStage(PREVIOUS&& previous)
+		: previous(std::move(previous)) {
 	}
 
-	Query(Query&& other)
-		: enumerator(std::move(other.enumerator)) {
+	template <typename QUERY>
+	auto operator()(QUERY&& query) const
+	-> decltype(std::declval<const PREVIOUS&>()(std::move(query)).template cast_dynamic<T>()) {
+		return previous(std::move(query)).template cast_dynamic<T>();
 	}
+};
 
-	class iterator
-	{
-		ENUMERATOR* enumerator;
-		mutable bool end;
-		mutable bool first;
-
-	public:
-
-		typedef typename ENUMERATOR::value_type value_type;
-		typedef std::forward_iterator_tag iterator_category;
-
-		iterator(ENUMERATOR* enumerator, bool end)
-			: enumerator(enumerator),
-			  end(end),
-			  first(true) {
-		}
 
-		bool operator!=(const iterator& other) const {
-			if (first && !end) {
-				first = false;
-				end = !enumerator->next();
-			}
+// Splits the source in chunks and runs the stages over each chunk in its own thread.
+// Transforms and predicates are copied to each chunk, so they must be safe to call in parallel.
+template <typename ENUMERATOR, typename STAGES>
+class ParallelQuery : no_copy
+{
+	ENUMERATOR source;
+	STAGES stages;
+	std::size_t threads;
 
-			return enumerator != other.enumerator || end != other.end;
-		}
+	typedef decltype(std::declval<const STAGES&>()(std::declval<Query<ENUMERATOR>>())) chunk_query_type;
 
-		value_type operator*() const {
-			return enumerator->get();
-		}
+public:
 
-		const iterator& operator++() {
-			end = !enumerator->next();
-			return *this;
-		}
-	};
+	typedef typename chunk_query_type::value_type value_type;
+	typedef typename chunk_query_type::simple_value_type simple_value_type;
 
-	iterator begin() {
-		return iterator(&enumerator, false);
+	ParallelQuery(ENUMERATOR&& source, STAGES&& stages, std::size_t threads)
+		: source(std::move(source)),
+		  stages(std::move(stages)),
+		  threads(threads) {
+		if (this->threads < 1)
+			this->threads = std::max(1u, std::thread::hardware_concurrency());
 	}
 
-	iterator end() {
-		return iterator(&enumerator, true);
+	ParallelQuery(ParallelQuery&& other)
+		: source(std::move(other.source)),
+		  stages(std::move(other.stages)),
+		  threads(other.threads) {
 	}
 
 	template <typename PREDICATE>
-	Query<EnumeratorWithFilter<ENUMERATOR, PREDICATE>> where(PREDICATE&& predicate) {
-		static_assert(std::is_same<typename std::result_of<PREDICATE(value_type)>::type, bool>::value, "PREDICATE must be a function: bool(value_type)");
+	ParallelQuery<ENUMERATOR, WhereStage<STAGES, typename std::decay<PREDICATE>::type>> where(PREDICATE&& predicate) {
+		typedef WhereStage<STAGES, typename std::decay<PREDICATE>::type> stage;
 
-		return Query<EnumeratorWithFilter<ENUMERATOR, PREDICATE>>(
-			EnumeratorWithFilter<ENUMERATOR, PREDICATE>(std::move(enumerator), std::move(predicate))
+		return ParallelQuery<ENUMERATOR, stage>(
+			std::move(source), stage(std::move(stages), std::forward<PREDICATE>(predicate)), threads
 		);
 	}
 
 	template <typename TRANSFORM>
-	Query<EnumeratorWithTransform<ENUMERATOR, TRANSFORM>> select(TRANSFORM&& transform) {
-		return Query<EnumeratorWithTransform<ENUMERATOR, TRANSFORM>>(
-			EnumeratorWithTransform<ENUMERATOR, TRANSFORM>(std::move(enumerator), std::move(transform))
-		);
-	}
+	ParallelQuery<ENUMERATOR, SelectStage<STAGES, typename std::decay<TRANSFORM>::type>> select(TRANSFORM&& transform) {
+		typedef SelectStage<STAGES, typename std::decay<TRANSFORM>::type> stage;
 
-	template <typename TRANSFORM>
-	Query<EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>> select_many(TRANSFORM&& transform) {
-		return Query<EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>>(
-			EnumeratorWithSelectMany<ENUMERATOR, TRANSFORM>(std::move(enumerator), std::move(transform))
+		return ParallelQuery<ENUMERATOR, stage>(
+			std::move(source), stage(std::move(stages), std::forward<TRANSFORM>(transform)), threads
 		);
 	}
 
-	Query<EnumeratorWithTake<ENUMERATOR>> take(std::size_t count) {
-		return Query<EnumeratorWithTake<ENUMERATOR>>(
-			EnumeratorWithTake<ENUMERATOR>(std::move(enumerator), count)
-		);
-	}
+	template <typename TRANSFORM>
+	ParallelQuery<ENUMERATOR, SelectManyStage<STAGES, typename std::decay<TRANSFORM>::type>> select_many(TRANSFORM&& transform) {
+		typedef SelectManyStage<STAGES, typename std::decay<TRANSFORM>::type> stage;
 
-	Query<EnumeratorWithSkip<ENUMERATOR>> skip(std::size_t count) {
-		return Query<EnumeratorWithSkip<ENUMERATOR>>(
-			EnumeratorWithSkip<ENUMERATOR>(std::move(enumerator), count)
+		return ParallelQuery<ENUMERATOR, stage>(
+			std::move(source), stage(std::move(stages), std::forward<TRANSFORM>(transform)), threads
 		);
 	}
 
 	template <typename T>
-	Query<EnumeratorWithStaticCast<ENUMERATOR, T>> cast_static() {
-		return Query<EnumeratorWithStaticCast<ENUMERATOR, T>>(
-			EnumeratorWithStaticCast<ENUMERATOR, T>(std::move(enumerator))
+	ParallelQuery<ENUMERATOR, StaticCastStage<STAGES, T>> cast_static() {
+		return ParallelQuery<ENUMERATOR, StaticCastStage<STAGES, T>>(
+			std::move(source), StaticCastStage<STAGES, T>(std::move(stages)), threads
 		);
 	}
 
 	template <typename T>
-	Query<EnumeratorWithDynamicCast<ENUMERATOR, T>> cast_dynamic() {
-		return Query<EnumeratorWithDynamicCast<ENUMERATOR, T>>(
-			EnumeratorWithDynamicCast<ENUMERATOR, T>(std::move(enumerator))
+	ParallelQuery<ENUMERATOR, DynamicCastStage<STAGES, T>> cast_dynamic() {
+		return ParallelQuery<ENUMERATOR, DynamicCastStage<STAGES, T>>(
+			std::move(source), DynamicCastStage<STAGES, T>(std::move(stages)), threads
 		);
 	}
 
+	// Keeps the order of the source
 	std::vector<simple_value_type> to_vector() {
-		std::vector<simple_value_type> result;
-		to(result);
-		return result;
-	}
+		std::size_t count = chunks();
+		std::vector<std::vector<simple_value_type>> partials(count);
 
-	std::list<simple_value_type> to_list() {
-		std::list<simple_value_type> result;
-		to(result);
-		return result;
-	}
+		auto func = [&](std::size_t i) {
+			partials[i] = chunk(i, count).to_vector();
+		};
+		run_parallel(count, func);
+
+		std::size_t total = 0;
+		for (std::size_t i = 0; i < count; ++i)
+			total += partials[i].size();
+
+		std::vector<simple_value_type> result;
+		result.reserve(total);
+		for (std::size_t i = 0; i < count; ++i)
+			std::move(partials[i].begin(), partials[i].end(), std::back_inserter(result));
 
-	std::set<simple_value_type> to_set() {
-		std::set<simple_value_type> result;
-		to(result);
 		return result;
 	}
 
@@ -459,103 +5282,324 @@ public:
 
 	template <typename OUTPUT_ITERATOR, typename OUTPUT_VALUE_TYPE = decltype(*std::declval<OUTPUT_ITERATOR>())>
 	void to(OUTPUT_ITERATOR result) {
-		while (enumerator.next()) {
-			*result = enumerator.get();
+		foreach([&](value_type value) {
+			*result = std::forward<value_type>(value);
 			++result;
-		}
+		});
 	}
 
+	// The stages run in parallel, but action is called in the calling thread, in the order of the source. The
+	// chunks are handed to action as soon as the ones before them are done. When the calling thread reaches a chunk
+	// that no worker started it runs it itself, calling action directly, and only the chunks run by the workers
+	// are kept until their turn.
 	template <typename ACTION>
 	void foreach(ACTION action) {
-		while (enumerator.next()) {
-			action(enumerator.get());
+		typedef storage<value_type> storage_type;
+
+		std::size_t count = chunks();
+		std::vector<std::vector<typename storage_type::type>> partials(count);
+
+		auto func = [&](std::size_t i) {
+			std::vector<typename storage_type::type>& partial = partials[i];
+			chunk(i, count).foreach([&](value_type value) {
+				partial.push_back(storage_type::store(std::forward<value_type>(value)));
+			});
+		};
+		ParallelCall<decltype(func)> call(count, func);
+		ParallelScope scope(call, count - 1);
+
+		for (std::size_t i = 0; i < count; ++i) {
+			if (call.claim(i)) {
+				chunk(i, count).foreach([&](value_type value) {
+					action(std::forward<value_type>(value));
+				});
+				continue;
+			}
+
+			call.wait(i);
+
+			std::vector<typename storage_type::type> partial;
+			partial.swap(partials[i]);
+			for (std::size_t j = 0; j < partial.size(); ++j)
+				action(storage_type::load(partial[j]));
 		}
 	}
 
-	template <typename PREDICATE>
-	bool any(PREDICATE& predicate) {
-		while (enumerator.next()) {
-			if (predicate(enumerator.get()))
-				return true;
+	// Each thread folds its chunk from a copy of seed in an accumulator on its own stack, so the threads do not
+	// share cache lines. The partial results are merged with combine(a, b) in a tree, keeping the order of the
+	// source. seed must not change the result when it is combined (0 for sums, an empty struct...).
+	template <typename T, typename ACCUMULATE, typename COMBINE>
+	T aggregate(const T& seed, ACCUMULATE accumulate, COMBINE combine) {
+		std::size_t count = chunks();
+		std::vector<T> partials(count, seed);
+
+		auto func = [&](std::size_t i) {
+			partials[i] = chunk(i, count).aggregate(seed, accumulate);
+		};
+		run_parallel(count, func);
+
+		for (std::size_t step = 1; step < count; step *= 2) {
+			for (std::size_t i = 0; i + step < count; i += 2 * step)
+				partials[i] = combine(partials[i], partials[i + step]);
 		}
 
-		return false;
+		return partials[0];
+	}
+
+	template <typename PREDICATE>
+	bool any(PREDICATE predicate) {
+		std::atomic<bool> found(false);
+		std::size_t count = chunks();
+
+		auto func = [&](std::size_t i) {
+			for (auto&& value : chunk(i, count)) {
+				if (found.load(std::memory_order_relaxed))
+					return;
+
+				if (predicate(value)) {
+					found.store(true, std::memory_order_relaxed);
+					return;
+				}
+			}
+		};
+		run_parallel(count, func);
+
+		return found.load();
 	}
 
 	bool any() {
-		return enumerator.next();
+		return any([](value_type) {
+			return true;
+		});
 	}
 
 	template <typename PREDICATE>
-	bool all(PREDICATE& predicate) {
-		while (enumerator.next()) {
-			if (!predicate(enumerator.get()))
-				return false;
-		}
-
-		return true;
+	bool all(PREDICATE predicate) {
+		return !any([&](value_type value) {
+			return !predicate(std::forward<value_type>(value));
+		});
 	}
 
-	value_type first() {
-		if (!enumerator.next())
-			throw std::exception("no item in result");
+private:
 
-		return enumerator.get();
+	std::size_t chunks() const {
+		std::size_t size = source.remaining();
+		std::size_t count = (size + parallel_min_chunk - 1) / parallel_min_chunk;
+		return std::max<std::size_t>(1, std::min(count, threads));
 	}
 
-	simple_value_type first_or_default(const simple_value_type& defaultValue) {
-		if (!enumerator.next())
-			return defaultValue;
+	chunk_query_type chunk(std::size_t index, std::size_t count) const {
+		std::size_t size = source.remaining();
+		std::size_t rest = size % count;
+		std::size_t begin = size / count * index + std::min(index, rest);
+		std::size_t end = begin + size / count + (index < rest ? 1 : 0);
 
-		return enumerator.get();
+		return stages(Query<ENUMERATOR>(source.slice(begin, end)));
 	}
+};
+}
 
-	simple_value_type first_or_default(simple_value_type&& defaultValue) {
-		if (!enumerator.next())
-			return std::move(defaultValue);
 
-		return enumerator.get();
-	}
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	template <class = typename std::enable_if<std::is_reference<value_type>::value>::type>
-	value_type first_or_default(value_type defaultValue) {
-		if (!enumerator.next())
-			return defaultValue;
 
-		return enumerator.get();
-	}
+// Group returned by group_by(): key(), size(), begin(), end()
+using detail::Grouping;
 
-	value_type first_or_default() {
-		if (!enumerator.next())
-			return value_type();
+// Query of T elements that can hold any query, converted from it
+template <typename T>
+using any_query = detail::Query<detail::AnyEnumerator<T>>;
 
-		return enumerator.get();
-	}
-};
-}
+#ifdef CLINQ_HAS_COROUTINES
 
+// Return type of the coroutines given to from_generator()
+template <typename T, typename ALLOCATOR = std::allocator<char>>
+using generator = detail::Generator<T, ALLOCATOR>;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#endif
 
 
 template <typename LIST, typename ITERATOR = decltype(std::declval<LIST>().begin())>
-detail::Query<detail::Enumerator<ITERATOR>> from(LIST& l) {
+CLINQ_CONSTEXPR detail::Query<detail::Enumerator<ITERATOR>> from(LIST& l) {
 	return detail::Query<detail::Enumerator<ITERATOR>>(
 		detail::Enumerator<ITERATOR>(l.begin(), l.end())
 	);
 }
 
+// Vectors are enumerated through pointers, so the contiguous kernels can be used
+template <typename value_type, typename ALLOCATOR, typename = typename std::enable_if<!std::is_same<value_type, bool>::value>::type>
+detail::Query<detail::Enumerator<value_type*>> from(std::vector<value_type, ALLOCATOR>& l) {
+	return detail::Query<detail::Enumerator<value_type*>>(
+		detail::Enumerator<value_type*>(l.data(), l.data() + l.size())
+	);
+}
+
+template <typename value_type, typename ALLOCATOR, typename = typename std::enable_if<!std::is_same<value_type, bool>::value>::type>
+detail::Query<detail::Enumerator<const value_type*>> from(const std::vector<value_type, ALLOCATOR>& l) {
+	return detail::Query<detail::Enumerator<const value_type*>>(
+		detail::Enumerator<const value_type*>(l.data(), l.data() + l.size())
+	);
+}
+
 template <typename value_type, int N>
-detail::Query<detail::Enumerator<value_type*>> from(value_type (&l)[N]) {
+CLINQ_CONSTEXPR detail::Query<detail::Enumerator<value_type*>> from(value_type (&l)[N]) {
 	return detail::Query<detail::Enumerator<value_type*>>(
 		detail::Enumerator<value_type*>(l, l + N)
 	);
 }
 
 template <typename value_type>
-detail::Query<detail::Enumerator<value_type*>> from(value_type* l, std::size_t len) {
+CLINQ_CONSTEXPR detail::Query<detail::Enumerator<value_type*>> from(value_type* l, std::size_t len) {
 	return detail::Query<detail::Enumerator<value_type*>>(
 		detail::Enumerator<value_type*>(l, l + len)
 	);
 }
+
+
+// Numbers from begin (included) to end (not included), separated by step. step can be negative, to count down.
+template <typename T>
+CLINQ_CONSTEXPR detail::Query<detail::IndexEnumerator<detail::RangeValue<T>>> range(T begin, T end, typename std::common_type<T>::type step = T(1)) {
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "range() needs numbers");
+
+	if (step == T())
+		throw std::invalid_argument("range() step can not be 0");
+
+	detail::RangeValue<T> value = { begin, step };
+	return detail::Query<detail::IndexEnumerator<detail::RangeValue<T>>>(
+		detail::IndexEnumerator<detail::RangeValue<T>>(value, 0, detail::range_size(begin, end, step, std::is_integral<T>()))
+	);
+}
+
+// count copies of value
+template <typename T>
+CLINQ_CONSTEXPR detail::Query<detail::IndexEnumerator<detail::RepeatValue<T>>> repeat(T value, std::size_t count) {
+	detail::RepeatValue<T> repeated = { std::move(value) };
+	return detail::Query<detail::IndexEnumerator<detail::RepeatValue<T>>>(
+		detail::IndexEnumerator<detail::RepeatValue<T>>(repeated, 0, count)
+	);
+}
+
+// func(0) ... func(count - 1). func is called when an element is read, maybe more than once for the same index and
+// from different threads in parallel queries, so it should only depend on the index.
+template <typename FUNC>
+CLINQ_CONSTEXPR detail::Query<detail::IndexEnumerator<FUNC>> generate(FUNC func, std::size_t count) {
+	return detail::Query<detail::IndexEnumerator<FUNC>>(
+		detail::IndexEnumerator<FUNC>(func, 0, count)
+	);
+}
+
+#ifdef CLINQ_HAS_COROUTINES
+
+// Elements yielded by a coroutine that returns generator<T>. The coroutine runs only when the query reads the next
+// element, and exceptions thrown by it are thrown by the query.
+template <typename T, typename ALLOCATOR>
+detail::Query<detail::GeneratorEnumerator<T, ALLOCATOR>> from_generator(detail::Generator<T, ALLOCATOR>&& g) {
+	return detail::Query<detail::GeneratorEnumerator<T, ALLOCATOR>>(
+		detail::GeneratorEnumerator<T, ALLOCATOR>(std::move(g))
+	);
+}
+
+#endif
+
+
+// Type of the query returned by from(SOURCE&), received by the function given to prepare()
+template <typename SOURCE>
+struct query_of
+{
+	typedef decltype(from(std::declval<SOURCE&>())) type;
+};
+
+
+namespace detail {
+
+// Result of a plan run: queries are copied to a vector kept between the runs, other results are returned as they are
+template <typename RESULT>
+class PlanOutput
+{
+public:
+
+	typedef RESULT result_type;
+
+	result_type collect(RESULT&& result) {
+		return std::forward<RESULT>(result);
+	}
+};
+
+// The storage of the operators of the query (sort buffers, group_by and join tables, the keys of distinct) is also
+// kept: it is lent to the query of each run and taken back when the elements are read
+template <typename ENUMERATOR>
+class PlanOutput<Query<ENUMERATOR>>
+{
+	std::vector<typename Query<ENUMERATOR>::simple_value_type> buffer;
+	PlanScratch scratch;
+
+public:
+
+	typedef const std::vector<typename Query<ENUMERATOR>::simple_value_type>& result_type;
+
+	PlanOutput() {
+	}
+
+	PlanOutput(PlanOutput&& other)
+		: buffer(std::move(other.buffer)),
+		  scratch(std::move(other.scratch)) {
+	}
+
+	result_type collect(Query<ENUMERATOR>&& query) {
+		// The groups of the previous run are released first, so group_by can reuse their storage
+		buffer.clear();
+
+		scratch.rewind();
+		recycle(query.enumerator, scratch);
+
+		query.to_vector(buffer);
+
+		scratch.rewind();
+		recycle(query.enumerator, scratch);
+		return buffer;
+	}
+};
+
+// Query shape returned by prepare(), built again over the source and parameters of each run. The output vector
+// and the storage of the operators are kept between the runs
+template <typename SOURCE, typename BUILD, typename... PARAMS>
+class Plan : no_copy
+{
+	typedef decltype(std::declval<BUILD&>()(std::declval<typename query_of<SOURCE>::type>(), std::declval<PARAMS>()...)) build_result_type;
+
+	BUILD build;
+	PlanOutput<build_result_type> output;
+
+public:
+
+	typedef typename PlanOutput<build_result_type>::result_type result_type;
+
+	explicit Plan(BUILD&& build)
+		: build(std::move(build)) {
+	}
+
+	Plan(Plan&& other)
+		: build(std::move(other.build)),
+		  output(std::move(other.output)) {
+	}
+
+	// When build returns a query the result is valid until the next run
+	result_type run(SOURCE& source, PARAMS... params) {
+		return output.collect(build(from(source), params...));
+	}
+};
+}
+
+
+// Prepares a query that is run many times over different sources and parameters. build receives the
+// query_of<SOURCE>::type and the PARAMS given to run(), and returns a query or the result of a terminal
+// operation. Queries are copied to a vector reused by all the runs, so a plan must be used by one thread at a time.
+// The sort buffers of order_by, the tables of group_by and join and the keys of distinct are also reused, except
+// the groups still referenced by the caller. Plans returning the result of a terminal operation keep nothing.
+template <typename SOURCE, typename... PARAMS, typename BUILD>
+detail::Plan<SOURCE, typename std::decay<BUILD>::type, PARAMS...> prepare(BUILD&& build) {
+	return detail::Plan<SOURCE, typename std::decay<BUILD>::type, PARAMS...>(
+		typename std::decay<BUILD>::type(std::forward<BUILD>(build))
+	);
+}
 }
@@ -0,0 +1,598 @@
+#pragma once
+
+#include "clinq.h"
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define CLINQ_STRING_VIEW
+#include <string_view>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace clinq
+{
+#ifdef CLINQ_STRING_VIEW
+
+typedef std::string_view string_view;
+
+#else
+
+// Characters inside a mapped file, for compilers without std::string_view
+class string_view
+{
+	const char* begin_;
+	std::size_t size_;
+
+public:
+
+	typedef const char* const_iterator;
+	typedef const char* iterator;
+
+	string_view()
+		: begin_(nullptr),
+		  size_(0) {
+	}
+
+	string_view(const char* data, std::size_t size)
+		: begin_(data),
+		  size_(size) {
+	}
+
+	string_view(const char* str)
+		: begin_(str),
+		  size_(std::strlen(str)) {
+	}
+
+	string_view(const std::string& str)
+		: begin_(str.data()),
+		  size_(str.size()) {
+	}
+
+	const char* data() const {
+		return begin_;
+	}
+
+	std::size_t size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return size_ == 0;
+	}
+
+	const char* begin() const {
+		return begin_;
+	}
+
+	const char* end() const {
+		return begin_ + size_;
+	}
+
+	char operator[](std::size_t i) const {
+		return begin_[i];
+	}
+
+	string_view substr(std::size_t pos, std::size_t count = std::size_t(-1)) const {
+		pos = std::min(pos, size_);
+		return string_view(begin_ + pos, std::min(count, size_ - pos));
+	}
+
+	int compare(string_view other) const {
+		int result = std::memcmp(begin_, other.begin_, std::min(size_, other.size_));
+		if (result != 0)
+			return result;
+
+		return size_ < other.size_ ? -1 : size_ > other.size_ ? 1 : 0;
+	}
+
+	bool operator==(string_view other) const {
+		return size_ == other.size_ && std::memcmp(begin_, other.begin_, size_) == 0;
+	}
+
+	bool operator!=(string_view other) const {
+		return !(*this == other);
+	}
+
+	bool operator<(string_view other) const {
+		return compare(other) < 0;
+	}
+};
+
+#endif
+
+
+// Format of the records read by from_csv(): the field delimiter (',' or '\t' for TSV), the character that quotes
+// fields and if the first record is a header that must be skipped
+struct csv_format
+{
+	char delimiter;
+	char quote;
+	bool header;
+
+	explicit csv_format(char delimiter = ',', bool header = false, char quote = '"')
+		: delimiter(delimiter),
+		  quote(quote),
+		  header(header) {
+	}
+};
+
+// One record of a CSV source. It only points to the characters of the record: a field is found when it is read,
+// so the fields that are not read are never parsed.
+class csv_row
+{
+	const char* begin_;
+	const char* end_;
+	csv_format format;
+	bool quoted;
+
+	// Returns the delimiter (or end) after the field that starts at it, and the field value without the quotes
+	const char* field(const char* it, string_view& value) const {
+		if (!quoted || it == end_ || *it != format.quote) {
+			const char* delimiter = static_cast<const char*>(std::memchr(it, format.delimiter, std::size_t(end_ - it)));
+			if (delimiter == nullptr)
+				delimiter = end_;
+			value = string_view(it, std::size_t(delimiter - it));
+			return delimiter;
+		}
+
+		// Quoted field: doubled quotes are part of the value, so look for a quote that is not followed by another
+		const char* first = it + 1;
+		const char* close = first;
+		for (;;) {
+			close = static_cast<const char*>(std::memchr(close, format.quote, std::size_t(end_ - close)));
+			if (close == nullptr) {
+				value = string_view(first, std::size_t(end_ - first));
+				return end_;
+			}
+			if (close + 1 == end_ || close[1] != format.quote)
+				break;
+			close += 2;
+		}
+		value = string_view(first, std::size_t(close - first));
+
+		const char* delimiter = static_cast<const char*>(std::memchr(close, format.delimiter, std::size_t(end_ - close)));
+		return delimiter == nullptr ? end_ : delimiter;
+	}
+
+public:
+
+	csv_row()
+		: begin_(nullptr),
+		  end_(nullptr),
+		  quoted(false) {
+	}
+
+	csv_row(const char* begin, const char* end, const csv_format& format, bool quoted)
+		: begin_(begin),
+		  end_(end),
+		  format(format),
+		  quoted(quoted) {
+	}
+
+	// The whole record, without the line break
+	string_view record() const {
+		return string_view(begin_, std::size_t(end_ - begin_));
+	}
+
+	std::size_t size() const {
+		std::size_t result = 1;
+		string_view value;
+		for (const char* it = field(begin_, value); it != end_; it = field(it + 1, value))
+			++result;
+		return result;
+	}
+
+	// The field at index, without the quotes. Doubled quotes inside quoted fields are kept doubled: use text() to
+	// get them as one. Fields after the last one are empty.
+	string_view operator[](std::size_t index) const {
+		string_view value;
+		const char* it = field(begin_, value);
+		for (; index > 0; --index) {
+			if (it == end_)
+				return string_view();
+			it = field(it + 1, value);
+		}
+		return value;
+	}
+
+	std::string text(std::size_t index) const {
+		string_view value = (*this)[index];
+		std::string result(value.data(), value.size());
+		if (quoted) {
+			const char doubled[] = { format.quote, format.quote, 0 };
+			for (std::size_t pos = result.find(doubled); pos != std::string::npos; pos = result.find(doubled, pos + 1))
+				result.erase(pos, 1);
+		}
+		return result;
+	}
+
+	double number(std::size_t index) const {
+		string_view value = (*this)[index];
+		char buffer[64];
+		std::size_t size = std::min(value.size(), sizeof(buffer) - 1);
+		std::memcpy(buffer, value.data(), size);
+		buffer[size] = 0;
+		return std::strtod(buffer, nullptr);
+	}
+};
+
+namespace detail
+{
+
+// Read only mapping of a whole file. Empty files are not mapped.
+class MappedFile : no_copy
+{
+	const char* data_;
+	std::size_t size_;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+public:
+
+	explicit MappedFile(const char* path)
+		: data_(nullptr),
+		  size_(0) {
+#ifdef _WIN32
+		mapping = nullptr;
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("could not open file");
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size)) {
+			CloseHandle(file);
+			throw std::runtime_error("could not read file size");
+		}
+		size_ = std::size_t(size.QuadPart);
+		if (size_ < 1)
+			return;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping != nullptr)
+			data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+
+		if (data_ == nullptr) {
+			if (mapping != nullptr)
+				CloseHandle(mapping);
+			CloseHandle(file);
+			throw std::runtime_error("could not map file");
+		}
+#else
+		int file = ::open(path, O_RDONLY);
+		if (file < 0)
+			throw std::runtime_error("could not open file");
+
+		struct stat info;
+		if (::fstat(file, &info) != 0) {
+			::close(file);
+			throw std::runtime_error("could not read file size");
+		}
+		size_ = std::size_t(info.st_size);
+		if (size_ < 1) {
+			::close(file);
+			return;
+		}
+
+		// The mapping stays valid after the file is closed
+		void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, file, 0);
+		::close(file);
+		if (data == MAP_FAILED)
+			throw std::runtime_error("could not map file");
+
+		::madvise(data, size_, MADV_SEQUENTIAL);
+		data_ = static_cast<const char*>(data);
+#endif
+	}
+
+	~MappedFile() {
+#ifdef _WIN32
+		if (data_ != nullptr)
+			UnmapViewOfFile(data_);
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		if (data_ != nullptr)
+			::munmap(const_cast<char*>(data_), size_);
+#endif
+	}
+
+	const char* data() const {
+		return data_;
+	}
+
+	std::size_t size() const {
+		return size_;
+	}
+};
+
+// Lines of a mapped file, without the line break ("\n" or "\r\n"). The views point inside the mapping, that is
+// kept while any enumerator created from it exists.
+class LineEnumerator
+{
+	std::shared_ptr<MappedFile> file;
+	string_view current;
+	const char* following;
+	const char* end;
+
+	// Finds the end of the line that starts at begin, memchr scans for the break with vector instructions
+	static string_view line(const char* begin, const char* end, const char*& following) {
+		const char* brk = static_cast<const char*>(std::memchr(begin, '\n', std::size_t(end - begin)));
+		if (brk == nullptr) {
+			following = end;
+			return string_view(begin, std::size_t(end - begin));
+		}
+
+		following = brk + 1;
+		if (brk > begin && brk[-1] == '\r')
+			--brk;
+		return string_view(begin, std::size_t(brk - begin));
+	}
+
+public:
+
+	typedef string_view value_type;
+
+	explicit LineEnumerator(const std::shared_ptr<MappedFile>& file)
+		: file(file),
+		  following(file->data()),
+		  end(file->data() + file->size()) {
+	}
+
+	LineEnumerator(LineEnumerator&& other)
+		: file(std::move(other.file)),
+		  current(other.current),
+		  following(other.following),
+		  end(other.end) {
+	}
+
+	bool next() {
+		if (following == end)
+			return false;
+
+		current = line(following, end, following);
+		return true;
+	}
+
+	value_type get() {
+		return current;
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		// Local copies, so the loop does not go through this
+		const char* it = following;
+		const char* last = end;
+		while (it != last) {
+			string_view value = line(it, last, it);
+			if (!sink(value)) {
+				current = value;
+				following = it;
+				return false;
+			}
+		}
+
+		following = it;
+		return true;
+	}
+
+	SizeHint size_hint() const {
+		return SizeHint::unknown();
+	}
+};
+
+// Records of a CSV file or buffer. Line breaks inside quoted fields are part of the record.
+class CsvEnumerator
+{
+	std::shared_ptr<MappedFile> file;
+	csv_format format;
+	csv_row current;
+	const char* following;
+	const char* end;
+
+	// Finds the end of the record that starts at begin. Records without quotes only need the memchr scan for the
+	// line break, the others skip the quoted parts (from quote to quote) looking for the break after them.
+	csv_row record(const char* begin, const char*& following) const {
+		const char* brk = static_cast<const char*>(std::memchr(begin, '\n', std::size_t(end - begin)));
+		if (brk == nullptr)
+			brk = end;
+
+		bool quoted = false;
+		const char* it = begin;
+		for (;;) {
+			const char* open = static_cast<const char*>(std::memchr(it, format.quote, std::size_t(brk - it)));
+			if (open == nullptr)
+				break;
+
+			quoted = true;
+			const char* close = static_cast<const char*>(std::memchr(open + 1, format.quote, std::size_t(end - open - 1)));
+			if (close == nullptr) {
+				brk = end;
+				break;
+			}
+
+			it = close + 1;
+			if (it > brk) {
+				brk = static_cast<const char*>(std::memchr(it, '\n', std::size_t(end - it)));
+				if (brk == nullptr)
+					brk = end;
+			}
+		}
+
+		following = brk == end ? end : brk + 1;
+		if (brk > begin && brk[-1] == '\r')
+			--brk;
+		return csv_row(begin, brk, format, quoted);
+	}
+
+public:
+
+	typedef csv_row value_type;
+
+	CsvEnumerator(const char* data, std::size_t size, const std::shared_ptr<MappedFile>& file, const csv_format& format)
+		: file(file),
+		  format(format),
+		  following(data),
+		  end(data + size) {
+		if (format.header && following != end)
+			record(following, following);
+	}
+
+	CsvEnumerator(CsvEnumerator&& other)
+		: file(std::move(other.file)),
+		  format(other.format),
+		  current(other.current),
+		  following(other.following),
+		  end(other.end) {
+	}
+
+	bool next() {
+		if (following == end)
+			return false;
+
+		current = record(following, following);
+		return true;
+	}
+
+	value_type get() {
+		return current;
+	}
+
+	template <typename SINK>
+	bool push(SINK& sink) {
+		const char* it = following;
+		while (it != end) {
+			csv_row value = record(it, it);
+			if (!sink(value)) {
+				current = value;
+				following = it;
+				return false;
+			}
+		}
+
+		following = it;
+		return true;
+	}
+
+	SizeHint size_hint() const {
+		return SizeHint::unknown();
+	}
+};
+
+// Enumerator over the records of a mapped file, that keeps the mapping while it (or a slice of it) exists
+template <typename T>
+class MappedEnumerator : public Enumerator<const T*>
+{
+	std::shared_ptr<MappedFile> file;
+
+public:
+
+	MappedEnumerator(Enumerator<const T*>&& records, const std::shared_ptr<MappedFile>& file)
+		: Enumerator<const T*>(std::move(records)),
+		  file(file) {
+	}
+
+	MappedEnumerator(MappedEnumerator&& other)
+		: Enumerator<const T*>(std::move(other)),
+		  file(std::move(other.file)) {
+	}
+
+	MappedEnumerator slice(std::size_t from, std::size_t to) const {
+		return MappedEnumerator(Enumerator<const T*>::slice(from, to), file);
+	}
+};
+
+template <typename T>
+struct is_splittable<MappedEnumerator<T>> : std::true_type
+{
+};
+
+template <typename T>
+struct is_random_access<MappedEnumerator<T>> : std::true_type
+{
+};
+
+template <typename T>
+struct is_contiguous<MappedEnumerator<T>> : std::is_arithmetic<T>
+{
+};
+
+}
+
+
+// Lines of the file at path, as string_views into a read only mapping of the file. A view is valid while the
+// query (or any query built from it) exists: copy it to a std::string to keep it after that.
+inline detail::Query<detail::LineEnumerator> from_file_lines(const char* path) {
+	return detail::Query<detail::LineEnumerator>(
+		detail::LineEnumerator(std::make_shared<detail::MappedFile>(path))
+	);
+}
+
+inline detail::Query<detail::LineEnumerator> from_file_lines(const std::string& path) {
+	return from_file_lines(path.c_str());
+}
+
+// Records of a file that is a flat array of T, read directly from a read only mapping of the file. The query is
+// random access: skip() does not read the skipped records and parallel() splits the file between the threads.
+template <typename T>
+detail::Query<detail::MappedEnumerator<T>> from_mapped(const char* path) {
+	static_assert(std::is_trivially_copyable<T>::value, "from_mapped() needs records that can be copied as bytes");
+
+	std::shared_ptr<detail::MappedFile> file = std::make_shared<detail::MappedFile>(path);
+	if (file->size() % sizeof(T) != 0)
+		throw std::runtime_error("file size is not a multiple of the record size");
+
+	return detail::Query<detail::MappedEnumerator<T>>(
+		detail::MappedEnumerator<T>(
+			detail::Enumerator<const T*>(reinterpret_cast<const T*>(file->data()), reinterpret_cast<const T*>(file->data() + file->size())),
+			file
+		)
+	);
+}
+
+template <typename T>
+detail::Query<detail::MappedEnumerator<T>> from_mapped(const std::string& path) {
+	return from_mapped<T>(path.c_str());
+}
+
+// Records of the CSV (or TSV, with csv_format('\t')) file at path, read from a read only mapping of the file. The
+// rows and their fields point inside the mapping, so they are valid while the query exists.
+inline detail::Query<detail::CsvEnumerator> from_csv(const char* path, const csv_format& format = csv_format()) {
+	std::shared_ptr<detail::MappedFile> file = std::make_shared<detail::MappedFile>(path);
+	return detail::Query<detail::CsvEnumerator>(
+		detail::CsvEnumerator(file->data(), file->size(), file, format)
+	);
+}
+
+inline detail::Query<detail::CsvEnumerator> from_csv(const std::string& path, const csv_format& format = csv_format()) {
+	return from_csv(path.c_str(), format);
+}
+
+// Records of CSV text that is already in memory. The text is not copied, so it must exist while the query does.
+inline detail::Query<detail::CsvEnumerator> from_csv_buffer(string_view text, const csv_format& format = csv_format()) {
+	return detail::Query<detail::CsvEnumerator>(
+		detail::CsvEnumerator(text.data(), text.size(), std::shared_ptr<detail::MappedFile>(), format)
+	);
+}
+}
@@ -1,6 +1,15 @@
 #include <gtest/gtest.h>
 #include <clinq.h>
+#include <clinq_io.h>
 #include <chrono>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <climits>
 #include <stdlib.h> 
 
 using namespace clinq;
@@ -76,6 +85,65 @@ TEST(clinq, fom_list_to_vector) {
 	ASSERT_EQ("b", b[1]);
 }
 
+// Single pass source: its iterators read from the stream
+template <typename ITERATOR>
+struct StreamSource
+{
+	istringstream in;
+
+	explicit StreamSource(const string& text)
+		: in(text) {
+	}
+
+	ITERATOR begin() {
+		return ITERATOR(in);
+	}
+
+	ITERATOR end() {
+		return ITERATOR();
+	}
+};
+
+TEST(clinq, from_input_iterator) {
+	StreamSource<istreambuf_iterator<char>> chars("abc");
+
+	auto q = from(chars);
+	auto it = q.begin();
+	ASSERT_EQ('a', *it);
+	ASSERT_EQ('b', *++it);
+	ASSERT_EQ('c', *++it);
+	ASSERT_TRUE(++it == q.end());
+
+	StreamSource<istreambuf_iterator<char>> more("abcdef");
+
+	vector<char> b = from(more)
+			.where([](char c) {
+				return c != 'c';
+			})
+			.to_vector();
+
+	ASSERT_EQ("abdef", string(b.begin(), b.end()));
+}
+
+TEST(clinq, from_input_iterator_references) {
+	StreamSource<istream_iterator<string>> words("one two three four");
+
+	auto q = from(words);
+	ASSERT_EQ("one", q.first());
+
+	const string* batch[10];
+	vector<string> b;
+	size_t count;
+	while ((count = q.next_batch(batch, 10)) > 0) {
+		for (size_t i = 0; i < count; i++)
+			b.push_back(*batch[i]);
+	}
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ("two", b[0]);
+	ASSERT_EQ("four", b[2]);
+}
+
 TEST(clinq, select_int) {
 	list<string> l;
 	l.push_back("a");
@@ -244,6 +312,19 @@ TEST(clinq, all_false) {
 	ASSERT_EQ(false, b);
 }
 
+TEST(clinq, any_all_keep_lvalue_predicates) {
+	list<string> l;
+	l.push_back("a");
+	l.push_back("bb");
+
+	auto longer = [](string& i) {
+		return i.length() > 1;
+	};
+
+	ASSERT_TRUE(from(l).any(longer));
+	ASSERT_FALSE(from(l).all(longer));
+}
+
 TEST(clinq, take) {
 	list<string> l;
 	l.push_back("a");
@@ -483,92 +564,2603 @@ TEST(clinq, first_or_default_non_ref_list_object_no_item) {
 	EXPECT_EQ(0, Helper::moved);
 }
 
-template <typename FUNC>
-long profile(FUNC f) {
-	auto t1 = chrono::high_resolution_clock::now();
-	f();
-	auto t2 = chrono::high_resolution_clock::now();
+TEST(clinq, parallel_to_vector_keeps_order) {
+	vector<int> l;
+	for (int i = 0; i < 100000; i++)
+		l.push_back(i);
 
-	return (long) chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+	vector<int> b = from(l)
+			.parallel(4)
+			.where([](int& i) {
+				return i % 3 == 0;
+			})
+			.select([](int& i) {
+				return i * 2;
+			})
+			.to_vector();
+
+	ASSERT_EQ(33334, b.size());
+	for (size_t i = 0; i < b.size(); i++)
+		ASSERT_EQ((int) i * 6, b[i]);
 }
 
-long x(long a) {
-	return a;
+TEST(clinq, parallel_small_source) {
+	int l[] = { 1, 2, 3 };
+
+	vector<long> b = from(l)
+			.parallel()
+			.cast_static<long>()
+			.to_vector();
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(1l, b[0]);
+	ASSERT_EQ(3l, b[2]);
 }
 
-#define INTERS 100000
+TEST(clinq, parallel_foreach_keeps_order) {
+	vector<int> l;
+	for (int i = 0; i < 20000; i++)
+		l.push_back(i);
 
-TEST(performance, simple_for) {
-	vector<long> l(INTERS);
-	for (long i = 0; i < INTERS; i++)
+	vector<int> b;
+	from(l)
+			.parallel(3)
+			.foreach([&](int& i) {
+				i++;
+				b.push_back(i);
+			});
+
+	ASSERT_EQ(20000, b.size());
+	for (size_t i = 0; i < b.size(); i++) {
+		ASSERT_EQ((int) i + 1, b[i]);
+		ASSERT_EQ((int) i + 1, l[i]);
+	}
+}
+
+TEST(clinq, parallel_any_all) {
+	vector<int> l;
+	for (int i = 0; i < 100000; i++)
 		l.push_back(i);
 
-	auto orig = profile([&]() {
-		long result = 0;
-		for (auto i : l)
-			result += i;
-		return result;
-	});
+	ASSERT_TRUE(from(l).parallel(4).any([](int& i) {
+		return i == 99999;
+	}));
+	ASSERT_FALSE(from(l).parallel(4).any([](int& i) {
+		return i < 0;
+	}));
+	ASSERT_TRUE(from(l).parallel(4).all([](int& i) {
+		return i >= 0;
+	}));
+	ASSERT_FALSE(from(l).parallel(4).all([](int& i) {
+		return i != 50000;
+	}));
+}
 
-	auto clinq = profile([&]() {
-		long result = 0;
-		for (auto i : from(l))
-			result += i;
-		return result;
-	});
+// Counts the threads that ran a stage: each one constructs its own instance on first use
+struct ThreadCounter
+{
+	static atomic<int> created;
 
-	EXPECT_LE(clinq, orig * 1.6);
+	ThreadCounter() {
+		created++;
+	}
+
+	void touch() {
+	}
+};
+
+atomic<int> ThreadCounter::created(0);
+
+thread_local ThreadCounter thread_counter;
+
+TEST(clinq, parallel_reuses_threads) {
+	vector<int> l(100000, 1);
+
+	thread_counter.touch();
+	for (int run = 0; run < 20; run++) {
+		from(l)
+				.parallel(4)
+				.where([](int& i) {
+					thread_counter.touch();
+					return i > 0;
+				})
+				.to_vector();
+	}
+
+	// The calling thread and the workers of the pool, that other tests may have grown up to parallel()'s threads
+	ASSERT_LE(ThreadCounter::created.load(), max<int>(4, int(thread::hardware_concurrency())));
 }
 
-TEST(performance, select) {
-	vector<long> l(INTERS);
-	for (long i = 0; i < INTERS; i++)
+TEST(clinq, parallel_errors) {
+	vector<int> l;
+	for (int i = 0; i < 100000; i++)
 		l.push_back(i);
 
-	auto orig = profile([&]() {
-		long result = 0;
-		for (auto i : l)
-			result += i;
-		return result;
-	});
+	ASSERT_THROW(from(l).parallel(4).where([](int& i) {
+		if (i == 70000)
+			throw runtime_error("stage");
+		return true;
+	}).to_vector(), runtime_error);
+
+	size_t seen = 0;
+	ASSERT_THROW(from(l).parallel(4).foreach([&](int& i) {
+		if (i == 30000)
+			throw runtime_error("action");
+		seen++;
+	}), runtime_error);
+	ASSERT_EQ(30000, seen);
+
+	ASSERT_EQ(100000, from(l).parallel(4).to_vector().size());
+}
 
-	auto clinq = profile([&]() {
-		long result = 0;
-		for (auto i : from(l).select([](long& x) {
-			     return x - 1;
-		     }))
-			result += i;
-		return result;
-	});
+TEST(clinq, parallel_nested) {
+	vector<int> l;
+	for (int i = 0; i < 20000; i++)
+		l.push_back(i);
 
-	EXPECT_LE(clinq, orig * 1.6);
+	vector<size_t> b = from(l)
+			.parallel(4)
+			.where([&](int& i) {
+				return i % 5000 == 0;
+			})
+			.select([&](int& i) {
+				return from(l).parallel(4).where([&](int& j) {
+					return j < i;
+				}).to_vector().size();
+			})
+			.to_vector();
+
+	ASSERT_EQ(vector<size_t>({ 0, 5000, 10000, 15000 }), b);
 }
 
-TEST(performance, select_many) {
-	vector<vector<long>> l(INTERS / 10);
-	for (long i = 0; i < INTERS / 10; i++) {
-		l.push_back(vector<long>());
-		vector<long>& v = l.back();
-		for (int i = 0; i < 10; i++)
-			v.push_back(i);
+TEST(clinq, parallel_empty) {
+	vector<int> l;
+
+	ASSERT_EQ(0, from(l).parallel().to_vector().size());
+	ASSERT_FALSE(from(l).parallel().any());
+}
+
+TEST(clinq, next_batch) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back(i);
+
+	auto q = from(l)
+			.skip(3)
+			.where([](int& i) {
+				return i % 2 == 1;
+			})
+			.select([](int& i) {
+				return i * 2;
+			})
+			.take(300)
+			.cast_static<long>();
+
+	long batch[256];
+	vector<long> b;
+	size_t count;
+	while ((count = q.next_batch(batch, 256)) > 0) {
+		ASSERT_LE(count, 256);
+		b.insert(b.end(), batch, batch + count);
 	}
 
-	auto orig = profile([&]() {
-		long result = 0;
-		for (auto v : l)
-			for (auto i : v)
-				result += i;
-		return result;
-	});
+	ASSERT_EQ(300, b.size());
+	for (size_t i = 0; i < b.size(); i++)
+		ASSERT_EQ((long) (3 + 2 * i) * 2, b[i]);
+}
 
-	auto clinq = profile([&]() {
-		long result = 0;
-		for (auto i : from(l).select_many([](vector<long>& x) {
-			     return x;
-		     }))
-			result += i;
-		return result;
+TEST(clinq, next_batch_keeps_references) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back(i);
+
+	auto q = from(l)
+			.where([](int& i) {
+				return i >= 500;
+			});
+
+	int* batch[10];
+	ASSERT_EQ(10, q.next_batch(batch, 10));
+	ASSERT_EQ(&l[500], batch[0]);
+	ASSERT_EQ(&l[509], batch[9]);
+}
+
+TEST(clinq, next_batch_select_many) {
+	vector<vector<int>> l(100, vector<int>(10, 1));
+
+	auto q = from(l)
+			.select_many([](vector<int>& i) {
+				return i;
+			})
+			.where([](int& i) {
+				return i > 0;
+			})
+			.take(25);
+
+	int* batch[256];
+	ASSERT_EQ(10, q.next_batch(batch));
+	ASSERT_EQ(10, q.next_batch(batch));
+	ASSERT_EQ(5, q.next_batch(batch));
+	ASSERT_EQ(0, q.next_batch(batch));
+}
+
+TEST(clinq, next_batch_fallback) {
+	list<string> l;
+	l.push_back("a");
+	l.push_back("bb");
+
+	auto q = from(l)
+			.select([](string& i) {
+				return i + i;
+			})
+			.select([](string i) {
+				return i.length();
+			});
+
+	size_t batch[256];
+	ASSERT_EQ(2, q.next_batch(batch));
+	ASSERT_EQ(2, batch[0]);
+	ASSERT_EQ(4, batch[1]);
+	ASSERT_EQ(0, q.next_batch(batch));
+}
+
+template <typename T>
+void test_compact(int level) {
+	for (size_t size = 0; size < 300; size += 7) {
+		vector<T> in;
+		vector<unsigned char> keep;
+		vector<T> expected;
+		for (size_t i = 0; i < size; i++) {
+			in.push_back(T(i * 3 + 1));
+			keep.push_back(rand() % 3 == 0 ? 1 : 0);
+			if (keep.back())
+				expected.push_back(in.back());
+		}
+
+		vector<T> out(size + 1);
+		size_t count = detail::compact(in.data(), keep.data(), size, out.data(), level);
+
+		ASSERT_EQ(expected.size(), count);
+		for (size_t i = 0; i < count; i++)
+			ASSERT_EQ(expected[i], out[i]);
+	}
+}
+
+TEST(clinq, compact_kernels) {
+	for (int level = detail::simd_none; level <= detail::simd_level(); level++) {
+		test_compact<int>(level);
+		test_compact<float>(level);
+		test_compact<double>(level);
+		test_compact<long long>(level);
+		test_compact<short>(level);
+		test_compact<char>(level);
+	}
+}
+
+template <typename T>
+void test_block_kernels(int level) {
+	auto twice = [](T& i) {
+		return double(i) * 2;
+	};
+	auto odd = [](T& i) {
+		return (long long) i % 2 == 1;
+	};
+
+	for (size_t size = 0; size < 100; size += 3) {
+		vector<T> in;
+		for (size_t i = 0; i < size; i++)
+			in.push_back(T(i * 3 + 1));
+
+		vector<double> doubled(size + 1);
+		detail::transform_values(in.data(), size, doubled.data(), twice, level);
+
+		vector<unsigned char> keep(size + 1);
+		detail::test_values(in.data(), size, keep.data(), odd, level);
+
+		for (size_t i = 0; i < size; i++) {
+			ASSERT_EQ(double(i * 6 + 2), doubled[i]);
+			ASSERT_EQ(i % 2 == 0 ? 1 : 0, keep[i]);
+		}
+	}
+}
+
+TEST(clinq, block_kernels) {
+	for (int level = detail::simd_none; level <= detail::simd_level(); level++) {
+		test_block_kernels<int>(level);
+		test_block_kernels<float>(level);
+		test_block_kernels<double>(level);
+		test_block_kernels<long long>(level);
+		test_block_kernels<short>(level);
+	}
+}
+
+TEST(clinq, where_contiguous_to_vector) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back(i);
+
+	vector<int> b = from(l)
+			.where([](int& i) {
+				return i % 3 == 0;
+			})
+			.to_vector();
+
+	ASSERT_EQ(334, b.size());
+	for (size_t i = 0; i < b.size(); i++)
+		ASSERT_EQ((int) i * 3, b[i]);
+}
+
+TEST(clinq, select_contiguous_to_vector) {
+	const vector<double> l(1000, 1.5);
+
+	vector<float> b = from(l)
+			.select([](const double& i) {
+				return float(i * 2);
+			})
+			.skip(10)
+			.take(900)
+			.to_vector();
+
+	ASSERT_EQ(900, b.size());
+	ASSERT_EQ(3.f, b[0]);
+	ASSERT_EQ(3.f, b[899]);
+}
+
+TEST(clinq, where_contiguous_take) {
+	long l[1000];
+	for (int i = 0; i < 1000; i++)
+		l[i] = i;
+
+	vector<long> b = from(l)
+			.where([](long& i) {
+				return i % 2 == 0;
+			})
+			.take(300)
+			.to_vector();
+
+	ASSERT_EQ(300, b.size());
+	ASSERT_EQ(0, b[0]);
+	ASSERT_EQ(598, b[299]);
+}
+
+TEST(clinq, size_hint) {
+	vector<int> v(100);
+	list<int> l(100);
+
+	auto exact = from(v).size_hint();
+	ASSERT_EQ(100, exact.size);
+	ASSERT_TRUE(exact.exact);
+
+	ASSERT_FALSE(from(l).size_hint().known());
+
+	auto transformed = from(v)
+			.select([](int& i) {
+				return i + 1;
+			})
+			.cast_static<long>()
+			.size_hint();
+	ASSERT_EQ(100, transformed.size);
+	ASSERT_TRUE(transformed.exact);
+
+	auto filtered = from(v)
+			.where([](int& i) {
+				return i > 0;
+			})
+			.size_hint();
+	ASSERT_EQ(100, filtered.size);
+	ASSERT_FALSE(filtered.exact);
+
+	auto paged = from(v).skip(30).take(50).size_hint();
+	ASSERT_EQ(50, paged.size);
+	ASSERT_TRUE(paged.exact);
+
+	auto last_page = from(v).skip(80).take(50).size_hint();
+	ASSERT_EQ(20, last_page.size);
+	ASSERT_TRUE(last_page.exact);
+
+	auto taken = from(l).take(10).size_hint();
+	ASSERT_EQ(10, taken.size);
+	ASSERT_FALSE(taken.exact);
+}
+
+TEST(clinq, to_vector_reserves) {
+	vector<string> l(1000, "a");
+
+	vector<string> b = from(l)
+			.select([](string& i) {
+				return i + "b";
+			})
+			.to_vector();
+
+	ASSERT_EQ(1000, b.size());
+	ASSERT_EQ(1000, b.capacity());
+}
+
+TEST(clinq, skip_random_access) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	vector<int> b = from(l)
+			.select([&](int& i) {
+				calls++;
+				return i * 2;
+			})
+			.skip(500)
+			.take(3)
+			.to_vector();
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(1000, b[0]);
+	ASSERT_EQ(1004, b[2]);
+	ASSERT_EQ(3, calls);
+}
+
+TEST(clinq, skip_nested_random_access) {
+	int l[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+
+	vector<long> b = from(l)
+			.skip(2)
+			.take(6)
+			.skip(3)
+			.cast_static<long>()
+			.skip(1)
+			.to_vector();
+
+	ASSERT_EQ(2, b.size());
+	ASSERT_EQ(6l, b[0]);
+	ASSERT_EQ(7l, b[1]);
+}
+
+TEST(clinq, skip_random_access_more_than_exists) {
+	vector<int> l(10);
+
+	ASSERT_EQ(0, from(l).skip(5).skip(10).to_vector().size());
+	ASSERT_EQ(0, from(l).take(3).skip(5).to_vector().size());
+}
+
+TEST(clinq, push_any_stops_early) {
+	list<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	bool result = from(l)
+			.select([&](int& i) {
+				calls++;
+				return i;
+			})
+			.any([](int i) {
+				return i == 10;
+			});
+
+	ASSERT_TRUE(result);
+	ASSERT_EQ(11, calls);
+}
+
+TEST(clinq, push_take_stops_early) {
+	list<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	vector<int> b;
+	from(l)
+			.where([&](int& i) {
+				calls++;
+				return i % 2 == 1;
+			})
+			.take(3)
+			.foreach([&](int& i) {
+				b.push_back(i);
+			});
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(1, b[0]);
+	ASSERT_EQ(5, b[2]);
+	ASSERT_EQ(6, calls);
+}
+
+TEST(clinq, push_select_many_skip) {
+	vector<vector<int>> l;
+	for (int i = 0; i < 4; i++)
+		l.push_back(vector<int>(3, i));
+
+	vector<int> b;
+	from(l)
+			.select_many([](vector<int>& i) {
+				return i;
+			})
+			.skip(4)
+			.to(back_inserter(b));
+
+	ASSERT_EQ(8, b.size());
+	ASSERT_EQ(1, b[0]);
+	ASSERT_EQ(3, b[7]);
+}
+
+TEST(clinq, where_evaluates_select_once) {
+	vector<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	auto q = from(l)
+			.select([&](int& i) {
+				calls++;
+				return to_string(i);
+			})
+			.where([](const string& i) {
+				return i != "3";
+			});
+
+	vector<string> b;
+	for (string s : q)
+		b.push_back(s);
+
+	ASSERT_EQ(9, b.size());
+	ASSERT_EQ("4", b[3]);
+	ASSERT_EQ(10, calls);
+}
+
+TEST(clinq, where_first_keeps_reference) {
+	vector<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	int& result = from(l)
+			.where([](int& i) {
+				return i > 4;
+			})
+			.first();
+
+	ASSERT_EQ(&l[5], &result);
+}
+
+TEST(clinq, select_many_reference) {
+	vector<vector<int>> l;
+	l.push_back(vector<int>(2, 1));
+	l.push_back(vector<int>());
+	l.push_back(vector<int>(3, 2));
+
+	vector<int*> b;
+	for (int& i : from(l).select_many([](vector<int>& i) -> vector<int>& {
+		     return i;
+	     }))
+		b.push_back(&i);
+
+	ASSERT_EQ(5, b.size());
+	ASSERT_EQ(&l[0][0], b[0]);
+	ASSERT_EQ(&l[2][2], b[4]);
+}
+
+TEST(clinq, select_many_owned_list) {
+	int l[] = { 1, 2, 3 };
+
+	vector<string> b = from(l)
+			.select_many([](int& i) {
+				return vector<string>(i, to_string(i));
+			})
+			.where([](const string& i) {
+				return i != "2";
+			})
+			.to_vector();
+
+	ASSERT_EQ(4, b.size());
+	ASSERT_EQ("1", b[0]);
+	ASSERT_EQ("3", b[3]);
+}
+
+TEST(clinq, iterator_input) {
+	list<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	auto q = from(l).where([](int& i) {
+		return i % 3 == 0;
+	});
+
+	auto it = q.begin();
+	ASSERT_EQ(0, *it++);
+	ASSERT_EQ(3, *it);
+
+	vector<int> b;
+	copy(it, q.end(), back_inserter(b));
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(3, b[0]);
+	ASSERT_EQ(9, b[2]);
+}
+
+TEST(clinq, iterator_input_empty) {
+	list<int> l;
+
+	auto q = from(l).where([](int& i) {
+		return i > 0;
+	});
+
+	ASSERT_TRUE(q.begin() == q.end());
+}
+
+TEST(clinq, iterator_random_access_sort) {
+	int l[] = { 9, 5, 7, 1, 3, 0 };
+
+	auto q = from(l).skip(1).take(4);
+	sort(q.begin(), q.end());
+
+	ASSERT_EQ(4, q.end() - q.begin());
+	ASSERT_EQ(9, l[0]);
+	ASSERT_EQ(1, l[1]);
+	ASSERT_EQ(3, l[2]);
+	ASSERT_EQ(5, l[3]);
+	ASSERT_EQ(7, l[4]);
+	ASSERT_EQ(0, l[5]);
+}
+
+TEST(clinq, iterator_random_access_lower_bound) {
+	vector<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	auto q = from(l).select([&](int& i) {
+		calls++;
+		return i * 2;
+	});
+
+	auto it = lower_bound(q.begin(), q.end(), 51);
+
+	ASSERT_EQ(26, it - q.begin());
+	ASSERT_EQ(52, *it);
+	ASSERT_LT(calls, 10);
+}
+
+TEST(clinq, order_by) {
+	int l[] = { 5, 3, 9, 1, 7 };
+
+	vector<int> b = from(l)
+			.order_by([](int& i) {
+				return i;
+			})
+			.to_vector();
+
+	ASSERT_EQ(5, b.size());
+	ASSERT_EQ(1, b[0]);
+	ASSERT_EQ(3, b[1]);
+	ASSERT_EQ(9, b[4]);
+}
+
+TEST(clinq, order_by_descending_then_by) {
+	vector<pair<int, string>> l;
+	l.push_back(make_pair(1, string("b")));
+	l.push_back(make_pair(2, string("c")));
+	l.push_back(make_pair(1, string("a")));
+	l.push_back(make_pair(2, string("a")));
+
+	vector<pair<int, string>> b = from(l)
+			.order_by_descending([](pair<int, string>& i) {
+				return i.first;
+			})
+			.then_by([](pair<int, string>& i) {
+				return i.second;
+			})
+			.to_vector();
+
+	ASSERT_EQ(4, b.size());
+	ASSERT_EQ(make_pair(2, string("a")), b[0]);
+	ASSERT_EQ(make_pair(2, string("c")), b[1]);
+	ASSERT_EQ(make_pair(1, string("a")), b[2]);
+	ASSERT_EQ(make_pair(1, string("b")), b[3]);
+}
+
+TEST(clinq, order_by_keeps_lvalue_keys) {
+	vector<pair<int, string>> l;
+	l.push_back(make_pair(1, string("b")));
+	l.push_back(make_pair(2, string("c")));
+	l.push_back(make_pair(1, string("a")));
+
+	auto number = [](pair<int, string>& i) {
+		return i.first;
+	};
+	auto text = [](pair<int, string>& i) {
+		return i.second;
+	};
+
+	vector<pair<int, string>> b = from(l).order_by(number).then_by_descending(text).to_vector();
+	ASSERT_EQ(make_pair(1, string("b")), b[0]);
+	ASSERT_EQ(make_pair(2, string("c")), b[2]);
+
+	b = from(l).order_by_descending(number).then_by(text).to_vector();
+	ASSERT_EQ(make_pair(2, string("c")), b[0]);
+	ASSERT_EQ(make_pair(1, string("a")), b[1]);
+}
+
+TEST(clinq, order_by_is_stable) {
+	vector<pair<int, int>> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(make_pair(i % 3, i));
+
+	vector<pair<int, int>> b = from(l)
+			.where([](pair<int, int>&) {
+				return true;
+			})
+			.order_by([](pair<int, int>& i) {
+				return i.first;
+			})
+			.take(10)
+			.to_vector();
+
+	ASSERT_EQ(10, b.size());
+	for (int i = 0; i < 10; i++)
+		ASSERT_EQ(make_pair(0, i * 3), b[i]);
+}
+
+TEST(clinq, order_by_take_keeps_references) {
+	list<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back((i * 7919) % 1000);
+
+	vector<int*> b;
+	from(l)
+			.order_by_descending([](int& i) {
+				return i;
+			})
+			.skip(1)
+			.take(3)
+			.foreach([&](int& i) {
+				b.push_back(&i);
+			});
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(998, *b[0]);
+	ASSERT_EQ(997, *b[1]);
+	ASSERT_EQ(996, *b[2]);
+}
+
+TEST(clinq, order_by_select_take_values) {
+	list<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(100 - i);
+
+	auto q = from(l)
+			.select([](int& i) {
+				return to_string(i);
+			})
+			.order_by([](string& i) {
+				return i;
+			})
+			.take(2);
+
+	vector<string> b;
+	for (string s : q)
+		b.push_back(s);
+
+	ASSERT_EQ(2, b.size());
+	ASSERT_EQ("1", b[0]);
+	ASSERT_EQ("10", b[1]);
+}
+
+TEST(clinq, group_by) {
+	int l[] = { 1, 12, 3, 14, 25, 6, 11 };
+
+	vector<pair<int, vector<int>>> b;
+	from(l)
+			.group_by([](int& i) {
+				return i / 10;
+			})
+			.foreach([&](Grouping<int, int&>& g) {
+				b.push_back(make_pair(g.key(), vector<int>(g.begin(), g.end())));
+			});
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(0, b[0].first);
+	ASSERT_EQ(1, b[1].first);
+	ASSERT_EQ(2, b[2].first);
+	ASSERT_EQ(vector<int>({ 1, 3, 6 }), b[0].second);
+	ASSERT_EQ(vector<int>({ 12, 14, 11 }), b[1].second);
+	ASSERT_EQ(vector<int>({ 25 }), b[2].second);
+}
+
+TEST(clinq, group_by_keeps_references) {
+	vector<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	auto groups = from(l)
+			.group_by([](int& i) {
+				return i % 2 == 0;
+			})
+			.to_vector();
+
+	ASSERT_EQ(2, groups.size());
+	ASSERT_TRUE(groups[0].key());
+	ASSERT_EQ(5, groups[0].size());
+	ASSERT_EQ(&l[8], &groups[0].begin()[4]);
+	ASSERT_EQ(&l[1], &*groups[1].begin());
+}
+
+TEST(clinq, group_by_element) {
+	list<string> l;
+	l.push_back("apple");
+	l.push_back("bean");
+	l.push_back("avocado");
+	l.push_back("banana");
+	l.push_back("cherry");
+
+	vector<string> b = from(l)
+			.group_by([](string& i) {
+				return i[0];
+			}, [](string& i) {
+				return i.size();
+			})
+			.select([](Grouping<char, size_t>& g) {
+				size_t total = 0;
+				for (size_t size : g)
+					total += size;
+				return string(1, g.key()) + to_string(total);
+			})
+			.to_vector();
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ("a12", b[0]);
+	ASSERT_EQ("b10", b[1]);
+	ASSERT_EQ("c6", b[2]);
+}
+
+TEST(clinq, group_by_keeps_lvalue_selectors) {
+	list<string> l;
+	l.push_back("apple");
+	l.push_back("bean");
+	l.push_back("avocado");
+
+	auto initial = [](string& i) {
+		return i[0];
+	};
+	auto size = [](string& i) {
+		return i.size();
+	};
+
+	ASSERT_EQ(2, from(l).group_by(initial).count());
+
+	auto q = from(l).group_by(initial, size);
+	Grouping<char, size_t>& g = q.first();
+	ASSERT_EQ('a', g.key());
+	ASSERT_EQ(2, from(g).count());
+}
+
+TEST(clinq, group_by_many_keys) {
+	vector<int> l;
+	for (int i = 0; i < 100000; i++)
+		l.push_back(i * 1024);
+	for (int i = 0; i < 100000; i++)
+		l.push_back(i * 1024);
+
+	size_t groups = 0;
+	bool all_pairs = true;
+	from(l)
+			.group_by([](int& i) {
+				return i;
+			})
+			.foreach([&](Grouping<int, int&>& g) {
+				groups++;
+				all_pairs = all_pairs && g.size() == 2;
+			});
+
+	ASSERT_EQ(100000, groups);
+	ASSERT_TRUE(all_pairs);
+}
+
+TEST(clinq, join) {
+	vector<pair<int, string>> people;
+	people.push_back(make_pair(1, string("ann")));
+	people.push_back(make_pair(2, string("bob")));
+	people.push_back(make_pair(3, string("cid")));
+
+	list<pair<int, string>> pets;
+	pets.push_back(make_pair(2, string("rex")));
+	pets.push_back(make_pair(1, string("tom")));
+	pets.push_back(make_pair(2, string("max")));
+	pets.push_back(make_pair(4, string("kit")));
+
+	vector<string> b = from(people)
+			.join(from(pets), [](pair<int, string>& p) {
+				return p.first;
+			}, [](pair<int, string>& p) {
+				return p.first;
+			}, [](pair<int, string>& person, pair<int, string>& pet) {
+				return person.second + ":" + pet.second;
+			})
+			.to_vector();
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ("ann:tom", b[0]);
+	ASSERT_EQ("bob:rex", b[1]);
+	ASSERT_EQ("bob:max", b[2]);
+}
+
+TEST(clinq, join_keeps_lvalue_functions) {
+	vector<pair<int, string>> people;
+	people.push_back(make_pair(1, string("ann")));
+	people.push_back(make_pair(2, string("bob")));
+
+	list<pair<int, string>> pets;
+	pets.push_back(make_pair(2, string("rex")));
+	pets.push_back(make_pair(1, string("tom")));
+
+	auto id = [](pair<int, string>& p) {
+		return p.first;
+	};
+	auto both = [](pair<int, string>& person, pair<int, string>& pet) {
+		return person.second + ":" + pet.second;
+	};
+
+	vector<string> b = from(people).join(from(pets), id, id, both).to_vector();
+
+	ASSERT_EQ(2, b.size());
+	ASSERT_EQ("ann:tom", b[0]);
+	ASSERT_EQ("bob:rex", b[1]);
+}
+
+TEST(clinq, join_builds_smaller_side) {
+	vector<int> outer;
+	for (int i = 0; i < 100; i++)
+		outer.push_back(i % 10);
+
+	vector<int> inner;
+	for (int i = 0; i < 1000; i++)
+		inner.push_back(i);
+
+	int inner_keys = 0;
+	auto q = from(outer)
+			.join(from(inner), [](int& i) {
+				return i;
+			}, [&](int& i) {
+				inner_keys++;
+				return i;
+			}, [](int& o, int& i) {
+				return make_pair(&o, &i);
+			});
+
+	vector<pair<int*, int*>> b;
+	for (auto p : q)
+		b.push_back(p);
+
+	ASSERT_EQ(100, b.size());
+	ASSERT_EQ(1000, inner_keys);
+	// The inner side was streamed: results follow its order
+	ASSERT_EQ(0, *b[0].second);
+	ASSERT_EQ(&outer[0], b[0].first);
+	ASSERT_EQ(&outer[10], b[1].first);
+	ASSERT_EQ(9, *b[99].second);
+	ASSERT_EQ(&outer[99], b[99].first);
+}
+
+TEST(clinq, join_take) {
+	list<int> outer;
+	for (int i = 0; i < 100; i++)
+		outer.push_back(i % 5);
+
+	vector<int> inner(3, 1);
+
+	vector<int> b = from(outer)
+			.join(from(inner), [](int& i) {
+				return i;
+			}, [](int& i) {
+				return i;
+			}, [](int& o, int& i) {
+				return o + i;
+			})
+			.take(4)
+			.to_vector();
+
+	ASSERT_EQ(4, b.size());
+	ASSERT_EQ(2, b[0]);
+	ASSERT_EQ(2, b[3]);
+}
+
+TEST(clinq, distinct) {
+	int l[] = { 3, 1, 3, 2, 1, 4 };
+
+	vector<int> b = from(l).distinct().to_vector();
+
+	ASSERT_EQ(vector<int>({ 3, 1, 2, 4 }), b);
+}
+
+TEST(clinq, distinct_by) {
+	list<string> l;
+	l.push_back("apple");
+	l.push_back("avocado");
+	l.push_back("bean");
+	l.push_back("banana");
+	l.push_back("cherry");
+
+	vector<string> b;
+	for (string& s : from(l).distinct_by([](string& i) {
+		     return i[0];
+	     }))
+		b.push_back(s);
+
+	ASSERT_EQ(vector<string>({ "apple", "bean", "cherry" }), b);
+}
+
+TEST(clinq, distinct_by_keeps_lvalue_key) {
+	list<string> l;
+	l.push_back("apple");
+	l.push_back("avocado");
+	l.push_back("bean");
+
+	auto initial = [](string& i) {
+		return i[0];
+	};
+
+	vector<string> b = from(l).distinct_by(initial).to_vector();
+
+	ASSERT_EQ(vector<string>({ "apple", "bean" }), b);
+}
+
+TEST(clinq, distinct_take_stops_early) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back(i % 20);
+
+	int calls = 0;
+	vector<int> b = from(l)
+			.select([&](int& i) {
+				calls++;
+				return i;
+			})
+			.distinct()
+			.take(10)
+			.to_vector();
+
+	ASSERT_EQ(10, b.size());
+	ASSERT_EQ(9, b[9]);
+	ASSERT_EQ(10, calls);
+}
+
+TEST(clinq, count) {
+	vector<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	ASSERT_EQ(100, from(l).select([&](int& i) {
+		calls++;
+		return i;
+	}).count());
+	ASSERT_EQ(0, calls);
+
+	ASSERT_EQ(50, from(l).count([](int& i) {
+		return i % 2 == 0;
+	}));
+	ASSERT_EQ(0, from(l).where([](int& i) {
+		return i > 100;
+	}).count());
+}
+
+TEST(clinq, sum_min_max) {
+	vector<int> l;
+	for (int i = 0; i < 1000; i++)
+		l.push_back((i * 7919) % 1000 - 500);
+
+	ASSERT_EQ(-500, from(l).sum());
+	ASSERT_EQ(-500, from(l).min());
+	ASSERT_EQ(499, from(l).max());
+	ASSERT_EQ(998, from(l).max([](int& i) {
+		return i * 2;
+	}));
+	ASSERT_EQ(499 * 500 / 2, from(l).where([](int& i) {
+		return i > 0;
+	}).sum());
+
+	int expected = 0;
+	for (int i = 10; i < 30; i++)
+		expected += l[i];
+	ASSERT_EQ(expected, from(l).skip(10).take(20).sum());
+}
+
+TEST(clinq, sum_lists) {
+	list<double> l;
+	l.push_back(1.5);
+	l.push_back(-2);
+	l.push_back(4);
+
+	ASSERT_EQ(3.5, from(l).sum());
+	ASSERT_EQ(-2, from(l).min());
+	ASSERT_EQ(4, from(l).max());
+	ASSERT_EQ(7.5, from(l).sum([](double& i) {
+		return i < 0 ? -i : i;
+	}));
+}
+
+TEST(clinq, average) {
+	int l[] = { 2000000000, 2000000000, 2000000001 };
+
+	ASSERT_DOUBLE_EQ(2000000000 + 1.0 / 3, from(l).average());
+	ASSERT_DOUBLE_EQ(1.5, from(l).average([](int& i) {
+		return i % 2 == 0 ? 1.0 : 2.5;
+	}));
+}
+
+TEST(clinq, aggregates_keep_lvalue_functions) {
+	vector<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	vector<int> weights(10, 2);
+	auto weighted = [weights](int& i) {
+		return i * weights[size_t(i)];
+	};
+	auto even = [weights](int& i) {
+		return weights[size_t(i)] > 0 && i % 2 == 0;
+	};
+
+	ASSERT_EQ(90, from(l).sum(weighted));
+	ASSERT_EQ(0, from(l).min(weighted));
+	ASSERT_EQ(18, from(l).max(weighted));
+	ASSERT_DOUBLE_EQ(9.0, from(l).average(weighted));
+	ASSERT_EQ(5, from(l).count(even));
+	ASSERT_EQ(90, from(l).sum(weighted));
+	ASSERT_EQ(5, from(l).count(even));
+
+	vector<vector<int>> lists(3, vector<int>(2, 1));
+	auto items = [weights](vector<int>& i) -> vector<int>& {
+		return i;
+	};
+
+	ASSERT_EQ(6, from(lists).select_many(items).count());
+	ASSERT_EQ(6, from(lists).select_many(items).sum());
+}
+
+TEST(clinq, aggregates_no_item) {
+	vector<int> l;
+
+	ASSERT_EQ(0, from(l).sum());
+	ASSERT_EQ(0, from(l).count());
+	ASSERT_THROW(from(l).min(), runtime_error);
+	ASSERT_THROW(from(l).max(), runtime_error);
+	ASSERT_THROW(from(l).average(), runtime_error);
+	ASSERT_THROW(from(l).first(), runtime_error);
+}
+
+struct Moments
+{
+	long count;
+	double sum;
+	double squares;
+};
+
+TEST(clinq, aggregate) {
+	list<int> l;
+	for (int i = 1; i <= 4; i++)
+		l.push_back(i);
+
+	Moments seed = { 0, 0, 0 };
+	Moments m = from(l).aggregate(seed, [](Moments& m, int& i) {
+		m.count++;
+		m.sum += i;
+		m.squares += i * i;
+		return m;
+	});
+
+	ASSERT_EQ(4, m.count);
+	ASSERT_EQ(10, m.sum);
+	ASSERT_EQ(30, m.squares);
+
+	string s = from(l).aggregate(string(), [](const string& s, int& i) {
+		return s + to_string(i);
+	}, [](const string& a, const string& b) {
+		return a + b;
+	});
+	ASSERT_EQ("1234", s);
+}
+
+TEST(clinq, parallel_aggregate) {
+	vector<int> l;
+	for (int i = 0; i < 100000; i++)
+		l.push_back(i);
+
+	Moments seed = { 0, 0, 0 };
+	Moments m = from(l)
+			.parallel(7)
+			.where([](int& i) {
+				return i % 2 == 0;
+			})
+			.aggregate(seed, [](Moments& m, int& i) {
+				m.count++;
+				m.sum += i;
+				m.squares += double(i) * i;
+				return m;
+			}, [](const Moments& a, const Moments& b) {
+				Moments m = { a.count + b.count, a.sum + b.sum, a.squares + b.squares };
+				return m;
+			});
+
+	ASSERT_EQ(50000, m.count);
+	ASSERT_EQ(2499950000.0, m.sum);
+
+	// combine is not commutative: the order of the source is kept
+	vector<int> b = from(l)
+			.parallel(5)
+			.aggregate(vector<int>(), [](vector<int>& v, int& i) {
+				if (v.empty() || v.back() != i / 1000)
+					v.push_back(i / 1000);
+				return v;
+			}, [](const vector<int>& a, const vector<int>& b) {
+				vector<int> r = a;
+				for (int i : b)
+					if (r.empty() || r.back() != i)
+						r.push_back(i);
+				return r;
+			});
+
+	ASSERT_EQ(100, b.size());
+	for (int i = 0; i < 100; i++)
+		ASSERT_EQ(i, b[i]);
+}
+
+TEST(clinq, memoize) {
+	list<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	int calls = 0;
+	auto m = from(l)
+			.select([&](int& i) {
+				calls++;
+				return to_string(i);
+			})
+			.memoize();
+
+	ASSERT_EQ(0, calls);
+
+	vector<string> b = m.query().take(3).to_vector();
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ(3, calls);
+
+	vector<string> c;
+	for (string s : m)
+		c.push_back(s);
+	ASSERT_EQ(10, c.size());
+	ASSERT_EQ("9", c[9]);
+	ASSERT_EQ(10, calls);
+
+	ASSERT_EQ(10, m.query().count());
+	ASSERT_EQ("7", m.query().skip(7).first());
+	ASSERT_EQ(10, calls);
+}
+
+TEST(clinq, memoize_keeps_references) {
+	vector<int> l(5, 1);
+
+	auto m = from(l).memoize();
+
+	ASSERT_EQ(&l[0], &m.query().first());
+	ASSERT_EQ(&l[4], &*m.query().skip(4).begin());
+}
+
+TEST(clinq, memoize_concurrent_readers) {
+	list<int> l;
+	for (int i = 0; i < 10000; i++)
+		l.push_back(i);
+
+	atomic<int> calls(0);
+	auto m = from(l)
+			.select([&](int& i) {
+				calls++;
+				return i;
+			})
+			.memoize();
+
+	vector<long> sums(4);
+	vector<thread> threads;
+	for (int t = 0; t < 4; t++)
+		threads.push_back(thread([&, t]() {
+			sums[t] = m.query().aggregate(0L, [](long s, int i) {
+				return s + i;
+			});
+		}));
+	for (auto& t : threads)
+		t.join();
+
+	for (int t = 0; t < 4; t++)
+		ASSERT_EQ(49995000, sums[t]);
+	ASSERT_EQ(10000, calls.load());
+}
+
+TEST(clinq, prepare) {
+	auto plan = prepare<vector<int>, int>([](query_of<vector<int>>::type q, int min) {
+		return q.where([=](int& i) {
+					return i >= min;
+				})
+				.select([](int& i) {
+					return i * 2;
+				});
+	});
+
+	vector<int> a = { 1, 5, 3, 7 };
+	vector<int> b = { 4, 2 };
+
+	const vector<int>& r = plan.run(a, 4);
+	ASSERT_EQ(2, r.size());
+	ASSERT_EQ(10, r[0]);
+	ASSERT_EQ(14, r[1]);
+
+	const int* buffer = r.data();
+	const vector<int>& r2 = plan.run(b, 3);
+	ASSERT_EQ(1, r2.size());
+	ASSERT_EQ(8, r2[0]);
+	ASSERT_EQ(buffer, r2.data());
+
+	ASSERT_EQ(0, plan.run(b, 10).size());
+}
+
+TEST(clinq, prepare_terminal) {
+	auto plan = prepare<list<string>, string>([](query_of<list<string>>::type q, string prefix) {
+		return q.count([&](string& s) {
+			return s.compare(0, prefix.size(), prefix) == 0;
+		});
+	});
+
+	list<string> l = { "ab", "ac", "b" };
+
+	ASSERT_EQ(2, plan.run(l, "a"));
+	ASSERT_EQ(1, plan.run(l, "b"));
+	ASSERT_EQ(0, plan.run(l, "c"));
+}
+
+TEST(clinq, prepare_reuses_operator_storage) {
+	auto plan = prepare<vector<int>>([](query_of<vector<int>>::type q) {
+		return q.group_by([](int& i) {
+			return i % 3;
+		});
+	});
+
+	vector<int> a = { 1, 2, 3, 4, 5, 6, 7 };
+	vector<int> b = { 9, 8, 7, 6, 5, 4, 3 };
+
+	const int* keys = &plan.run(a)[0].key();
+	auto& r = plan.run(b);
+	ASSERT_EQ(3, r.size());
+	ASSERT_EQ(0, r[0].key());
+	ASSERT_EQ(keys, &r[0].key());
+	ASSERT_EQ((vector<int>{ 9, 6, 3 }), vector<int>(r[0].begin(), r[0].end()));
+
+	// Groups kept by the caller are not reused
+	auto kept = r[1];
+	plan.run(a);
+	ASSERT_EQ(2, kept.key());
+	ASSERT_EQ((vector<int>{ 8, 5 }), vector<int>(kept.begin(), kept.end()));
+}
+
+TEST(clinq, prepare_operators_between_runs) {
+	auto plan = prepare<vector<int>, vector<int>&>([](query_of<vector<int>>::type q, vector<int>& other) {
+		return q.distinct_by([](int& i) {
+					return i % 10;
+				})
+				.join(from(other), [](int& i) {
+					return i % 10;
+				}, [](int& o) {
+					return o % 10;
+				}, [](int& i, int& o) {
+					return i * 100 + o;
+				})
+				.order_by_descending([](int i) {
+					return i;
+				});
+	});
+
+	vector<int> a = { 1, 2, 11, 3, 12, 4 };
+	vector<int> o = { 21, 22, 23, 31 };
+	ASSERT_EQ((vector<int>{ 323, 222, 131, 121 }), plan.run(a, o));
+
+	vector<int> b = { 5, 15, 1 };
+	vector<int> p = { 11, 25 };
+	ASSERT_EQ((vector<int>{ 525, 111 }), plan.run(b, p));
+
+	vector<int> c;
+	ASSERT_EQ(0, plan.run(c, o).size());
+	ASSERT_EQ((vector<int>{ 323, 222, 131, 121 }), plan.run(a, o));
+}
+
+any_query<int> odd_doubles(vector<int>& l) {
+	return from(l)
+			.where([](int& i) {
+				return i % 2 == 1;
+			})
+			.select([](int& i) {
+				return i * 2;
+			});
+}
+
+struct HoldsQuery
+{
+	any_query<string&> names;
+
+	explicit HoldsQuery(list<string>& l)
+		: names(from(l).skip(1)) {
+	}
+};
+
+TEST(clinq, any_query) {
+	vector<int> l;
+	for (int i = 0; i < 200; i++)
+		l.push_back(i);
+
+	vector<int> r = odd_doubles(l).to_vector();
+	ASSERT_EQ(100, r.size());
+	ASSERT_EQ(2, r[0]);
+	ASSERT_EQ(398, r[99]);
+
+	ASSERT_EQ(10, odd_doubles(l).take(10).count());
+	ASSERT_EQ(10, odd_doubles(l).skip(2).first());
+	ASSERT_EQ(20000, odd_doubles(l).sum());
+
+	int count = 0;
+	for (auto i : odd_doubles(l)) {
+		ASSERT_EQ(count * 4 + 2, i);
+		count++;
+	}
+	ASSERT_EQ(100, count);
+}
+
+TEST(clinq, any_query_keeps_references) {
+	list<string> l = { "a", "b", "c" };
+
+	HoldsQuery h(l);
+	HoldsQuery moved(std::move(h));
+
+	string& b = moved.names.first();
+	ASSERT_EQ(&*++l.begin(), &b);
+}
+
+TEST(clinq, any_query_converts_elements) {
+	vector<int> l = { 3, 1, 2 };
+
+	any_query<long> q = from(l);
+	ASSERT_EQ(3, q.size_hint().size);
+	ASSERT_TRUE(q.size_hint().exact);
+
+	vector<long> r = q.to_vector();
+	ASSERT_EQ(3L, r[0]);
+	ASSERT_EQ(2L, r[2]);
+}
+
+TEST(clinq, any_query_large_enumerator) {
+	vector<int> l = { 1, 2, 3, 4 };
+	char big[CLINQ_ANY_SIZE] = { 1 };
+
+	any_query<int> q = from(l).where([=](int& i) {
+		return big[0] == 1 && i > 1;
+	});
+	any_query<int> moved(std::move(q));
+
+	ASSERT_EQ(9, moved.sum());
+}
+
+TEST(clinq, any_query_moves_read_elements) {
+	vector<string> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(to_string(i));
+
+	any_query<string> q = from(l);
+	ASSERT_EQ("0", q.first());
+
+	any_query<string> moved(std::move(q));
+	vector<string> b = moved.to_vector();
+
+	ASSERT_EQ(9, b.size());
+	ASSERT_EQ("1", b[0]);
+	ASSERT_EQ("9", b[8]);
+}
+
+TEST(clinq, any_query_size) {
+	// The batch is allocated when the query is read, it does not grow the query
+	ASSERT_LE(sizeof(any_query<string>), CLINQ_ANY_SIZE + 64);
+	ASSERT_EQ(sizeof(any_query<int>), sizeof(any_query<string>));
+}
+
+TEST(clinq, any_query_order_by_take) {
+	vector<int> l = { 5, 3, 4, 1, 2 };
+
+	any_query<int&> q = from(l).order_by([](int& i) {
+		return i;
+	});
+
+	vector<int> r = q.take(2).to_vector();
+	ASSERT_EQ(2, r.size());
+	ASSERT_EQ(1, r[0]);
+	ASSERT_EQ(2, r[1]);
+}
+
+TEST(clinq, any_query_join) {
+	// keys is the smaller side, with 6 elements for each key, so the batches end inside the matches of a key
+	vector<int> keys;
+	for (int i = 0; i < 60; i++)
+		keys.push_back(i % 10);
+
+	vector<int> values;
+	for (int i = 0; i < 100; i++)
+		values.push_back(i);
+
+	auto join = [&]() {
+		return from(keys)
+				.join(from(values), [](int& k) {
+					return k;
+				}, [](int& v) {
+					return v % 50;
+				}, [](int& k, int& v) {
+					return k * 1000 + v;
+				});
+	};
+
+	vector<int> expected = join().to_vector();
+	any_query<int> q = join();
+
+	ASSERT_EQ(120, expected.size());
+	ASSERT_EQ(expected, q.to_vector());
+}
+
+TEST(clinq, where_where_fused) {
+	vector<int> l;
+	for (int i = 0; i < 20; i++)
+		l.push_back(i);
+
+	int second = 0;
+	auto q = from(l)
+			.where([](int& i) {
+				return i % 2 == 0;
+			})
+			.where([&](int& i) {
+				second++;
+				return i % 3 == 0;
+			});
+
+	ASSERT_EQ(4, q.to_vector().size());
+	ASSERT_EQ(10, second);
+}
+
+TEST(clinq, fused_stages_are_merged) {
+	vector<int> l = { 1, 2, 3 };
+
+	auto twice = from(l).take(2).take(1);
+	static_assert(std::is_same<decltype(from(l).take(2)), decltype(twice)>::value, "take().take() is one take");
+
+	auto skips = from(l).skip(1).skip(1);
+	static_assert(std::is_same<decltype(from(l).skip(1)), decltype(skips)>::value, "skip().skip() is one skip");
+
+	auto casts = from(l).cast_static<long>().cast_static<double>();
+	static_assert(std::is_same<decltype(casts), detail::Query<detail::EnumeratorWithStaticCast<detail::Enumerator<int*>, double, long>>>::value, "one cast");
+
+	ASSERT_EQ(1, twice.count());
+	ASSERT_EQ(3, skips.first());
+	ASSERT_EQ(6.0, casts.sum());
+}
+
+TEST(clinq, select_select_fused) {
+	list<string> l = { "a", "bb", "ccc" };
+
+	vector<string> b = from(l)
+			.select([](string& s) {
+				return s.size();
+			})
+			.select([](size_t i) {
+				return to_string(i * 2);
+			})
+			.select([](string s) {
+				return s + "!";
+			})
+			.to_vector();
+
+	ASSERT_EQ(3, b.size());
+	ASSERT_EQ("2!", b[0]);
+	ASSERT_EQ("6!", b[2]);
+}
+
+TEST(clinq, select_select_keeps_references) {
+	struct Pair
+	{
+		string first;
+		string second;
+	};
+	vector<Pair> l(2);
+
+	string& s = from(l)
+			.select([](Pair& p) -> Pair& {
+				return p;
+			})
+			.select([](Pair& p) -> string& {
+				return p.second;
+			})
+			.skip(1)
+			.first();
+
+	ASSERT_EQ(&l[1].second, &s);
+}
+
+TEST(clinq, take_take_skip_skip) {
+	list<int> l;
+	for (int i = 0; i < 10; i++)
+		l.push_back(i);
+
+	vector<int> b = from(l)
+			.skip(2)
+			.skip(3)
+			.take(4)
+			.take(2)
+			.to_vector();
+
+	ASSERT_EQ(2, b.size());
+	ASSERT_EQ(5, b[0]);
+	ASSERT_EQ(6, b[1]);
+}
+
+TEST(clinq, cast_static_cast_static) {
+	list<double> l = { 1.7, -2.5 };
+
+	vector<double> b = from(l)
+			.cast_static<int>()
+			.cast_static<double>()
+			.to_vector();
+
+	ASSERT_EQ(2, b.size());
+	ASSERT_EQ(1.0, b[0]);
+	ASSERT_EQ(-2.0, b[1]);
+}
+
+#ifdef CLINQ_HAS_CONSTEXPR
+
+constexpr int odd_squares[] = { 1, 2, 3, 4, 5, 6, 7 };
+
+constexpr int sum_odd_squares() {
+	return from(odd_squares)
+			.where([](const int& i) {
+				return i % 2 == 1;
+			})
+			.select([](const int& i) {
+				return i * i;
+			})
+			.sum();
+}
+
+constexpr std::array<long, 3> square_table() {
+	int l[] = { 1, 2, 3, 4, 5, 6, 7 };
+
+	return from(l)
+			.skip(1)
+			.select([](int& i) {
+				return i * i;
+			})
+			.where([](int i) {
+				return i > 4;
+			})
+			.cast_static<long>()
+			.take(3)
+			.to_array<3>();
+}
+
+constexpr bool constexpr_terminals() {
+	int l[] = { 4, 2, 9, 1 };
+
+	return from(l).count() == 4
+	       && from(l).min() == 1
+	       && from(l).max() == 9
+	       && from(l).average() == 4.0
+	       && from(l).first() == 4
+	       && from(l).any([](int& i) { return i > 5; })
+	       && !from(l).all([](int& i) { return i > 1; })
+	       && from(l).where([](int& i) { return i > 1; }).where([](int& i) { return i < 9; }).count() == 2
+	       && from(l).aggregate(1, [](int a, int& i) { return a * i; }) == 72
+	       && from(l).to_array<6>()[5] == 0;
+}
+
+TEST(clinq, constexpr_pipeline) {
+	static_assert(sum_odd_squares() == 1 + 9 + 25 + 49, "evaluated at compile time");
+	static_assert(square_table()[0] == 9 && square_table()[2] == 25, "evaluated at compile time");
+	static_assert(constexpr_terminals(), "evaluated at compile time");
+	static_assert(range(1, 10, 2).sum() == 1 + 3 + 5 + 7 + 9, "evaluated at compile time");
+
+	ASSERT_EQ(84, sum_odd_squares());
+	ASSERT_EQ(16L, square_table()[1]);
+}
+
+#endif
+
+TEST(clinq, range) {
+	ASSERT_EQ(vector<int>({ 0, 1, 2, 3 }), range(0, 4).to_vector());
+	ASSERT_EQ(vector<int>({ 10, 7, 4, 1 }), range(10, 0, -3).to_vector());
+	ASSERT_EQ(vector<double>({ 0.0, 0.5, 1.0 }), range(0.0, 1.25, 0.5).to_vector());
+	ASSERT_EQ(0, range(5, 5).count());
+	ASSERT_EQ(0, range(5, 0).count());
+	ASSERT_ANY_THROW(range(0, 10, 0));
+
+	auto q = range(0, 1000, 2);
+	ASSERT_EQ(500, q.size_hint().size);
+	ASSERT_TRUE(q.size_hint().exact);
+
+	ASSERT_EQ(990, range(0, 1000, 2).skip(495).first());
+}
+
+TEST(clinq, range_limits) {
+	ASSERT_EQ(size_t(UINT_MAX), range(INT_MIN, INT_MAX).size_hint().size);
+	ASSERT_EQ(INT_MAX - 1, range(INT_MIN, INT_MAX).skip(UINT_MAX - 1).first());
+	ASSERT_EQ(INT_MIN + 1, range(INT_MAX, INT_MIN, -1).skip(UINT_MAX - 1).first());
+	ASSERT_EQ(vector<int>({ INT_MIN, -1, INT_MAX - 1 }), range(INT_MIN, INT_MAX, INT_MAX).to_vector());
+	ASSERT_EQ(vector<signed char>({ -100, -50, 0, 50 }), range<signed char>(-100, 100, 50).to_vector());
+	ASSERT_EQ(vector<unsigned>({ 0u, 2000000000u, 4000000000u }), range(0u, UINT_MAX, 2000000000u).to_vector());
+}
+
+TEST(clinq, range_random_access) {
+	auto q = range(0, 100).select([](int i) {
+		return i * i;
+	});
+
+	static_assert(is_same<iterator_traits<decltype(q.begin())>::iterator_category, random_access_iterator_tag>::value, "random access");
+	ASSERT_EQ(100, q.end() - q.begin());
+	ASSERT_EQ(49, q.begin()[7]);
+	ASSERT_TRUE(binary_search(q.begin(), q.end(), 81));
+}
+
+TEST(clinq, range_parallel) {
+	vector<long long> b = range(0LL, 10000LL)
+			.parallel(4)
+			.where([](long long i) {
+				return i % 3 == 0;
+			})
+			.to_vector();
+
+	ASSERT_EQ(3334, b.size());
+	ASSERT_EQ(9999, b.back());
+	ASSERT_EQ(3333LL * 3334 / 2 * 3, from(b).sum());
+}
+
+TEST(clinq, repeat) {
+	vector<string> b = repeat(string("a"), 3).to_vector();
+
+	ASSERT_EQ(vector<string>({ "a", "a", "a" }), b);
+	ASSERT_EQ(0, repeat(1, 0).count());
+	ASSERT_EQ(7, repeat(1, 7).sum());
+}
+
+TEST(clinq, generate) {
+	vector<string> b = generate([](size_t i) {
+				return to_string(i * 10);
+			}, 5)
+			.skip(2)
+			.to_vector();
+
+	ASSERT_EQ(vector<string>({ "20", "30", "40" }), b);
+	ASSERT_EQ(5, generate([](size_t i) { return i; }, 5).size_hint().size);
+}
+
+#ifdef CLINQ_HAS_COROUTINES
+
+generator<int> naturals(int& produced) {
+	for (int i = 0;; i++) {
+		produced++;
+		co_yield i;
+	}
+}
+
+TEST(clinq, from_generator) {
+	int produced = 0;
+	vector<int> b = from_generator(naturals(produced))
+			.where([](int i) {
+				return i % 2 == 0;
+			})
+			.take(5)
+			.to_vector();
+
+	ASSERT_EQ(vector<int>({ 0, 2, 4, 6, 8 }), b);
+	ASSERT_EQ(9, produced);
+}
+
+struct Node
+{
+	int value;
+	vector<Node> children;
+};
+
+generator<const Node&> walk(const Node& node) {
+	co_yield node;
+	for (auto& child : node.children)
+		co_yield walk(child);
+}
+
+TEST(clinq, from_generator_nested) {
+	Node root = { 1, { { 2, { { 3, {} } } }, { 4, {} } } };
+
+	vector<int> b = from_generator(walk(root))
+			.select([](const Node& n) {
+				return n.value;
+			})
+			.to_vector();
+
+	ASSERT_EQ(vector<int>({ 1, 2, 3, 4 }), b);
+	ASSERT_EQ(&root.children[1], &from_generator(walk(root)).skip(3).first());
+}
+
+generator<int> countdown(int n) {
+	if (n == 0)
+		co_return;
+
+	co_yield n;
+	co_yield countdown(n - 1);
+}
+
+TEST(clinq, from_generator_deep_recursion) {
+	ASSERT_EQ(100000, from_generator(countdown(100000)).count());
+}
+
+generator<int> failing() {
+	co_yield 1;
+	co_yield countdown(0);
+	throw runtime_error("failed");
+}
+
+TEST(clinq, from_generator_exception) {
+	ASSERT_EQ(1, from_generator(failing()).first());
+	ASSERT_ANY_THROW(from_generator(failing()).count());
+}
+
+static int allocated_frames = 0;
+
+template <typename T>
+struct CountingAllocator : std::allocator<T>
+{
+	template <typename U>
+	struct rebind
+	{
+		typedef CountingAllocator<U> other;
+	};
+
+	CountingAllocator() {
+	}
+
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>&) {
+	}
+
+	T* allocate(size_t n) {
+		allocated_frames++;
+		return std::allocator<T>::allocate(n);
+	}
+
+	void deallocate(T* p, size_t n) {
+		allocated_frames--;
+		std::allocator<T>::deallocate(p, n);
+	}
+};
+
+generator<int, CountingAllocator<char>> squares(int count) {
+	for (int i = 0; i < count; i++)
+		co_yield i * i;
+}
+
+TEST(clinq, from_generator_allocator) {
+	{
+		auto q = from_generator(squares(4));
+		ASSERT_EQ(1, allocated_frames);
+		ASSERT_EQ(14, q.sum());
+	}
+
+	ASSERT_EQ(0, allocated_frames);
+}
+
+#endif
+
+// File in the working directory, removed at the end of the test
+class TempFile
+{
+	string path;
+
+public:
+
+	TempFile(const string& name, const string& contents)
+		: path(name) {
+		ofstream out(path.c_str(), ios::binary);
+		out << contents;
+	}
+
+	~TempFile() {
+		remove(path.c_str());
+	}
+
+	const string& name() const {
+		return path;
+	}
+};
+
+TEST(clinq, from_file_lines) {
+	TempFile file("clinq_lines.txt", "a\nbb\r\n\nccc");
+
+	vector<string> b = from_file_lines(file.name())
+			.select([](clinq::string_view s) {
+				return string(s.data(), s.size());
+			})
+			.to_vector();
+
+	ASSERT_EQ(4, b.size());
+	ASSERT_EQ("a", b[0]);
+	ASSERT_EQ("bb", b[1]);
+	ASSERT_EQ("", b[2]);
+	ASSERT_EQ("ccc", b[3]);
+}
+
+TEST(clinq, from_file_lines_take) {
+	TempFile file("clinq_lines.txt", "1\n2\n3\n");
+
+	ASSERT_EQ(3, from_file_lines(file.name()).count());
+
+	auto q = from_file_lines(file.name()).skip(1).take(1);
+	auto it = q.begin();
+	ASSERT_EQ('2', (*it)[0]);
+	ASSERT_EQ(1, (*it).size());
+	ASSERT_TRUE(++it == q.end());
+}
+
+TEST(clinq, from_file_lines_empty) {
+	TempFile file("clinq_lines.txt", "");
+
+	ASSERT_EQ(0, from_file_lines(file.name()).count());
+}
+
+TEST(clinq, from_file_lines_missing_file) {
+	ASSERT_ANY_THROW(from_file_lines("clinq_missing.txt"));
+}
+
+struct Record
+{
+	int id;
+	double value;
+};
+
+TEST(clinq, from_mapped) {
+	vector<Record> records;
+	for (int i = 0; i < 1000; i++) {
+		Record r = { i, i * 0.5 };
+		records.push_back(r);
+	}
+	TempFile file("clinq_records.bin", string(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record)));
+
+	ASSERT_EQ(1000, from_mapped<Record>(file.name()).count());
+	ASSERT_EQ(990, from_mapped<Record>(file.name()).skip(990).first().id);
+
+	auto q = from_mapped<Record>(file.name());
+	static_assert(std::is_same<decltype(q)::iterator, decltype(q)::random_access_iterator>::value, "random access");
+
+	vector<int> ids = from_mapped<Record>(file.name())
+			.parallel(4)
+			.where([](const Record& r) {
+				return r.id % 100 == 0;
+			})
+			.select([](const Record& r) {
+				return r.id;
+			})
+			.to_vector();
+
+	ASSERT_EQ(10, ids.size());
+	ASSERT_EQ(900, ids[9]);
+}
+
+TEST(clinq, from_mapped_numbers) {
+	vector<double> values(100, 0.5);
+	TempFile file("clinq_values.bin", string(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(double)));
+
+	ASSERT_EQ(50.0, from_mapped<double>(file.name()).sum());
+}
+
+TEST(clinq, from_mapped_partial_record) {
+	TempFile file("clinq_records.bin", "12345");
+
+	ASSERT_ANY_THROW(from_mapped<int>(file.name()));
+}
+
+TEST(clinq, from_csv) {
+	string text = "id,name,value\r\n1,a,1.5\r\n2,\"b, \"\"c\"\"\",2.5\r\n3,\"multi\nline\",3\r\n";
+	TempFile file("clinq_values.csv", text);
+
+	vector<string> names = from_csv(file.name(), csv_format(',', true))
+			.select([](const csv_row& r) {
+				return r.text(1);
+			})
+			.to_vector();
+
+	ASSERT_EQ(3, names.size());
+	ASSERT_EQ("a", names[0]);
+	ASSERT_EQ("b, \"c\"", names[1]);
+	ASSERT_EQ("multi\nline", names[2]);
+
+	ASSERT_EQ(7.0, from_csv(file.name(), csv_format(',', true)).sum([](const csv_row& r) {
+		return r.number(2);
+	}));
+
+	// The rows point to the text, that is kept by the test
+	auto rows = from_csv_buffer(text).to_vector();
+	ASSERT_EQ(4, rows.size());
+	ASSERT_EQ(3, rows[2].size());
+	ASSERT_TRUE(rows[2][2] == "2.5");
+	ASSERT_TRUE(rows[2][3].empty());
+	ASSERT_TRUE(rows[1].record() == "1,a,1.5");
+}
+
+TEST(clinq, from_csv_buffer) {
+	string text = "a\t1\nb\t\nc\t3";
+
+	auto q = from_csv_buffer(text, csv_format('\t'))
+			.where([](const csv_row& r) {
+				return !r[1].empty();
+			})
+			.take(1);
+
+	ASSERT_EQ("a", q.first().text(0));
+	ASSERT_EQ(2, from_csv_buffer(text, csv_format('\t')).count([](const csv_row& r) {
+		return !r[1].empty();
+	}));
+	ASSERT_EQ(0, from_csv_buffer("", csv_format(',', true)).count());
+}
+
+template <typename FUNC>
+long profile(FUNC f) {
+	auto t1 = chrono::high_resolution_clock::now();
+	f();
+	auto t2 = chrono::high_resolution_clock::now();
+
+	return (long) chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+}
+
+long x(long a) {
+	return a;
+}
+
+#define INTERS 100000
+
+TEST(performance, simple_for) {
+	vector<long> l(INTERS);
+	for (long i = 0; i < INTERS; i++)
+		l.push_back(i);
+
+	auto orig = profile([&]() {
+		long result = 0;
+		for (auto i : l)
+			result += i;
+		return result;
+	});
+
+	auto clinq = profile([&]() {
+		long result = 0;
+		for (auto i : from(l))
+			result += i;
+		return result;
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, select) {
+	vector<long> l(INTERS);
+	for (long i = 0; i < INTERS; i++)
+		l.push_back(i);
+
+	auto orig = profile([&]() {
+		long result = 0;
+		for (auto i : l)
+			result += i;
+		return result;
+	});
+
+	auto clinq = profile([&]() {
+		long result = 0;
+		for (auto i : from(l).select([](long& x) {
+			     return x - 1;
+		     }))
+			result += i;
+		return result;
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, select_to_vector) {
+	vector<float> l;
+	for (int i = 0; i < INTERS * 100; i++)
+		l.push_back(float(i));
+
+	vector<float> orig_result;
+	auto orig = profile([&]() {
+		for (int j = 0; j < 5; j++) {
+			orig_result = vector<float>();
+			orig_result.reserve(l.size());
+			for (auto i : l)
+				orig_result.push_back(i * 1.5f + 2);
+		}
+	});
+
+	vector<float> clinq_result;
+	auto clinq = profile([&]() {
+		for (int j = 0; j < 5; j++) {
+			clinq_result = from(l)
+					.select([](float& x) {
+						return x * 1.5f + 2;
+					})
+					.to_vector();
+		}
+	});
+
+	EXPECT_EQ(orig_result, clinq_result);
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, select_many) {
+	vector<vector<long>> l(INTERS / 10);
+	for (long i = 0; i < INTERS / 10; i++) {
+		l.push_back(vector<long>());
+		vector<long>& v = l.back();
+		for (int i = 0; i < 10; i++)
+			v.push_back(i);
+	}
+
+	auto orig = profile([&]() {
+		long result = 0;
+		for (auto v : l)
+			for (auto i : v)
+				result += i;
+		return result;
+	});
+
+	auto clinq = profile([&]() {
+		long result = 0;
+		for (auto i : from(l).select_many([](vector<long>& x) {
+			     return x;
+		     }))
+			result += i;
+		return result;
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, select_many_reference) {
+	vector<vector<long>> l;
+	for (long i = 0; i < INTERS * 10; i++)
+		l.push_back(vector<long>(10, i));
+
+	volatile long total = 0;
+
+	auto orig = profile([&]() {
+		long result = 0;
+		for (auto& v : l)
+			for (auto i : v)
+				result += i;
+		total = result;
+	});
+
+	auto clinq = profile([&]() {
+		long result = 0;
+		from(l)
+			.select_many([](vector<long>& x) -> vector<long>& {
+				return x;
+			})
+			.foreach([&](long& i) {
+				result += i;
+			});
+		total = result;
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, where_to_vector) {
+	vector<int> l;
+	for (int i = 0; i < INTERS * 100; i++)
+		l.push_back(i);
+
+	vector<int> orig_result;
+	auto orig = profile([&]() {
+		for (int j = 0; j < 5; j++) {
+			orig_result = vector<int>();
+			for (auto i : l)
+				if ((i & 3) == 0)
+					orig_result.push_back(i);
+		}
+	});
+
+	vector<int> clinq_result;
+	auto clinq = profile([&]() {
+		for (int j = 0; j < 5; j++) {
+			clinq_result = from(l)
+					.where([](int& x) {
+						return (x & 3) == 0;
+					})
+					.to_vector();
+		}
+	});
+
+	EXPECT_EQ(orig_result, clinq_result);
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, skip_take_page) {
+	vector<long> l;
+	for (long i = 0; i < INTERS * 100; i++)
+		l.push_back(i);
+
+	size_t offset = l.size() - 100;
+
+	vector<long> orig_result;
+	auto orig = profile([&]() {
+		for (size_t i = offset; i < offset + 10; i++)
+			orig_result.push_back(l[i]);
+	});
+
+	vector<long> clinq_result;
+	auto clinq = profile([&]() {
+		clinq_result = from(l)
+				.select([](long& x) {
+					return x;
+				})
+				.skip(offset)
+				.take(10)
+				.to_vector();
+	});
+
+	EXPECT_EQ(orig_result, clinq_result);
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, order_by_take) {
+	vector<int> l;
+	for (long i = 0; i < INTERS * 10; i++)
+		l.push_back(rand());
+
+	vector<int> b;
+
+	auto orig = profile([&]() {
+		vector<int> sorted = l;
+		sort(sorted.begin(), sorted.end());
+		b.assign(sorted.begin(), sorted.begin() + 100);
+	});
+
+	auto clinq = profile([&]() {
+		b = from(l)
+			.order_by([](int& i) {
+				return i;
+			})
+			.take(100)
+			.to_vector();
+	});
+
+	ASSERT_EQ(100, b.size());
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, group_by) {
+	vector<int> l;
+	for (long i = 0; i < INTERS * 10; i++)
+		l.push_back(rand() % (INTERS * 2));
+
+	size_t groups = 0;
+
+	auto orig = profile([&]() {
+		map<int, vector<int>> m;
+		for (auto& i : l)
+			m[i].push_back(i);
+		groups = m.size();
+	});
+
+	auto clinq = profile([&]() {
+		groups = 0;
+		from(l)
+			.group_by([](int& i) {
+				return i;
+			})
+			.foreach([&](Grouping<int, int&>& g) {
+				groups += g.size() > 0 ? 1 : 0;
+			});
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, join) {
+	vector<int> outer;
+	for (long i = 0; i < INTERS * 10; i++)
+		outer.push_back(rand() % (INTERS * 10));
+
+	vector<int> inner;
+	for (long i = 0; i < INTERS; i++)
+		inner.push_back(rand() % (INTERS * 10));
+
+	size_t count = 0;
+
+	auto orig = profile([&]() {
+		unordered_multimap<int, int*> m;
+		for (auto& i : inner)
+			m.insert(make_pair(i, &i));
+
+		count = 0;
+		for (auto& o : outer) {
+			auto range = m.equal_range(o);
+			for (auto it = range.first; it != range.second; ++it)
+				count++;
+		}
+	});
+
+	auto clinq = profile([&]() {
+		count = 0;
+		from(outer)
+			.join(from(inner), [](int& i) {
+				return i;
+			}, [](int& i) {
+				return i;
+			}, [](int&, int&) {
+				return 1;
+			})
+			.foreach([&](int i) {
+				count += i;
+			});
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, distinct) {
+	vector<int> l;
+	for (long i = 0; i < INTERS * 10; i++)
+		l.push_back(rand() % (INTERS * 2));
+
+	size_t count = 0;
+
+	auto orig = profile([&]() {
+		set<int> seen;
+		vector<int> b;
+		for (auto& i : l)
+			if (seen.insert(i).second)
+				b.push_back(i);
+		count = b.size();
+	});
+
+	auto clinq = profile([&]() {
+		count = from(l).distinct().to_vector().size();
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, sum) {
+	vector<int> l;
+	for (long i = 0; i < INTERS * 100; i++)
+		l.push_back(rand() % 1000);
+
+	volatile long total = 0;
+
+	auto orig = profile([&]() {
+		long result = 0;
+		for (auto& i : l)
+			result += i * 2;
+		total = result;
+	});
+
+	auto clinq = profile([&]() {
+		total = from(l).sum([](int& i) {
+			return long(i) * 2;
+		});
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, prepare) {
+	vector<int> l;
+	for (int i = 0; i < 100; i++)
+		l.push_back(i);
+
+	vector<int> orig_result;
+	auto orig = profile([&]() {
+		for (int j = 0; j < INTERS * 2; j++) {
+			orig_result.clear();
+			for (auto i : l)
+				if (i >= j % 100)
+					orig_result.push_back(i);
+		}
+	});
+
+	auto plan = prepare<vector<int>, int>([](query_of<vector<int>>::type q, int min) {
+		return q.where([=](int& i) {
+			return i >= min;
+		});
+	});
+
+	size_t size = 0;
+	auto clinq = profile([&]() {
+		for (int j = 0; j < INTERS * 2; j++)
+			size += plan.run(l, j % 100).size();
+	});
+
+	EXPECT_EQ(orig_result, plan.run(l, (INTERS * 2 - 1) % 100));
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, any_query) {
+	vector<int> l;
+	for (int i = 0; i < INTERS * 100; i++)
+		l.push_back(i);
+
+	volatile long total = 0;
+
+	auto orig = profile([&]() {
+		for (int j = 0; j < 10; j++) {
+			total = from(l)
+					.where([](int& i) {
+						return (i & 3) == 0;
+					})
+					.select([](int& i) {
+						return long(i);
+					})
+					.aggregate(0L, [](long a, long i) {
+						return a + i;
+					});
+		}
+	});
+
+	auto clinq = profile([&]() {
+		for (int j = 0; j < 10; j++) {
+			any_query<long> q = from(l)
+					.where([](int& i) {
+						return (i & 3) == 0;
+					})
+					.select([](int& i) {
+						return long(i);
+					});
+
+			total = q.aggregate(0L, [](long a, long i) {
+				return a + i;
+			});
+		}
+	});
+
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+
+TEST(performance, from_file_lines) {
+	string contents;
+	for (int i = 0; i < INTERS * 10; i++)
+		contents += (i % 7 == 0 ? "ERROR " : "INFO ") + to_string(i) + " some message\n";
+	TempFile file("clinq_perf_lines.txt", contents);
+
+	size_t orig_count = 0;
+	auto orig = profile([&]() {
+		ifstream in(file.name().c_str());
+		vector<string> lines;
+		string line;
+		while (getline(in, line))
+			lines.push_back(line);
+
+		for (auto& l : lines)
+			if (l.compare(0, 5, "ERROR") == 0)
+				orig_count++;
+	});
+
+	size_t clinq_count = 0;
+	auto clinq = profile([&]() {
+		clinq_count = from_file_lines(file.name()).count([](clinq::string_view l) {
+			return l.substr(0, 5) == "ERROR";
+		});
+	});
+
+	EXPECT_EQ(orig_count, clinq_count);
+	EXPECT_LE(clinq, orig);
+}
+
+TEST(performance, from_mapped) {
+	vector<Record> records;
+	for (int i = 0; i < INTERS * 10; i++) {
+		Record r = { i, double(i % 100) };
+		records.push_back(r);
+	}
+	TempFile file("clinq_perf_records.bin", string(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record)));
+
+	double orig_total = 0;
+	auto orig = profile([&]() {
+		FILE* in = fopen(file.name().c_str(), "rb");
+		vector<Record> read(records.size());
+		size_t count = fread(read.data(), sizeof(Record), read.size(), in);
+		fclose(in);
+
+		for (size_t i = 0; i < count; i++)
+			if (read[i].id % 2 == 0)
+				orig_total += read[i].value;
+	});
+
+	double clinq_total = 0;
+	auto clinq = profile([&]() {
+		clinq_total = from_mapped<Record>(file.name())
+				.where([](const Record& r) {
+					return r.id % 2 == 0;
+				})
+				.sum([](const Record& r) {
+					return r.value;
+				});
+	});
+
+	EXPECT_EQ(orig_total, clinq_total);
+	EXPECT_LE(clinq, orig * 1.6);
+}
+
+TEST(performance, from_csv) {
+	string contents = "id,name,kind,value,comment\n";
+	for (int i = 0; i < INTERS * 10; i++)
+		contents += to_string(i) + ",name " + to_string(i) + "," + to_string(i % 7) + "," + to_string(i % 100) + ",\"some, comment\"\n";
+	TempFile file("clinq_perf_values.csv", contents);
+
+	double orig_total = 0;
+	auto orig = profile([&]() {
+		ifstream in(file.name().c_str());
+		string line;
+		getline(in, line);
+
+		vector<vector<string>> rows;
+		while (getline(in, line)) {
+			vector<string> fields;
+			string field;
+			bool quoted = false;
+			for (char c : line) {
+				if (c == '"')
+					quoted = !quoted;
+				else if (c == ',' && !quoted)
+					fields.push_back(move(field)), field.clear();
+				else
+					field += c;
+			}
+			fields.push_back(move(field));
+			rows.push_back(move(fields));
+		}
+
+		for (auto& r : rows)
+			if (r[2] == "3")
+				orig_total += atof(r[3].c_str());
+	});
+
+	double clinq_total = 0;
+	auto clinq = profile([&]() {
+		clinq_total = from_csv(file.name(), csv_format(',', true))
+				.where([](const csv_row& r) {
+					return r[2] == "3";
+				})
+				.sum([](const csv_row& r) {
+					return r.number(3);
+				});
+	});
+
+	EXPECT_EQ(orig_total, clinq_total);
+	EXPECT_LE(clinq, orig);
+}
+
+TEST(performance, range) {
+	long long orig_total = 0;
+	auto orig = profile([&]() {
+		vector<long long> l(INTERS * 10);
+		for (size_t i = 0; i < l.size(); i++)
+			l[i] = (long long) i;
+
+		orig_total = from(l)
+				.select([](long long i) {
+					return i * i % 7;
+				})
+				.sum();
+	});
+
+	long long clinq_total = 0;
+	auto clinq = profile([&]() {
+		clinq_total = range(0LL, (long long) INTERS * 10)
+				.select([](long long i) {
+					return i * i % 7;
+				})
+				.sum();
 	});
 
-	EXPECT_LE(clinq, orig * 2);
+	EXPECT_EQ(orig_total, clinq_total);
+	EXPECT_LE(clinq, orig);
 }